@@ -0,0 +1,20 @@
+#!/usr/bin/env python3
+# writes one large generated class to stdout, about 500 bytes per subroutine
+# usage: generate.py [number of subroutines]
+import sys
+
+count = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+
+out = sys.stdout
+out.write("/** Generated class\n * with doc comments\n */\nclass Big {\n    static int counter;\n")
+for i in range(count):
+    out.write(f"""    /** returns the value number {i}, computed the long way around */
+    function int value{i}(int argumentNumberOne, int argumentNumberTwo) {{
+        var int accumulatorVariable, temporaryVariable;   // locals
+        let accumulatorVariable = argumentNumberOne + argumentNumberTwo * {i % 32768};
+        let temporaryVariable = accumulatorVariable - (argumentNumberOne & {i % 32768});
+        do Output.printString("value number {i} has been computed");
+        return accumulatorVariable + temporaryVariable;
+    }}
+""")
+out.write("}\n")
@@ -0,0 +1,84 @@
+#!/bin/bash
+# builds the compiler, compares its output on the corpus with the reference .vm files, measures what a profile
+# gains on the corpus and reports peak RSS for a large generated class with and without --bounded-memory
+# usage: Benchmarks/run.sh [number of subroutines in the generated class]
+# set SANITIZE=1 to build with ASan and UBSan
+# after an intended change in the output, copy the .vm files compiled from Corpus/<Program> into Reference/<Program>
+cd "$(dirname "$0")" || exit 1
+subroutines=${1:-20000}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+flags="-O2"
+if [ -n "$SANITIZE" ]; then
+    flags="-O1 -g -fsanitize=address,undefined -fno-sanitize-recover=undefined"
+fi
+${CC:-cc} $flags -D_Nullable= -o "$work/jc" ../JackCompiler/main.c || exit 1
+jc="$work/jc"
+
+failures=0
+
+echo "== differential test against Reference/"
+for program in Corpus/*/; do
+    name=$(basename "$program")
+    mkdir -p "$work/compare/$name"
+    cp "$program"*.jack "$work/compare/$name/"
+    if ! "$jc" --compare "Reference/$name" "$work/compare/$name"; then
+        failures=$((failures + 1))
+    fi
+done
+
+echo "== profile-guided optimization, VM steps without and with --profile-use"
+for program in Corpus/*/; do
+    name=$(basename "$program")
+    plain="$work/plain/$name"
+    profiled="$work/profiled/$name"
+    mkdir -p "$plain" "$profiled"
+    cp "$program"*.jack "$plain/"
+    cp "$program"*.jack "$profiled/"
+
+    # a self tail call turns into a jump, which would not count as a call to the function
+    "$jc" --no-tail-calls "$plain" > /dev/null || { failures=$((failures + 1)); continue; }
+    PROFILE="$work/$name.profile" python3 vm.py "$plain" > /dev/null 2>&1
+
+    "$jc" "$plain" > /dev/null
+    "$jc" --profile-use "$work/$name.profile" "$profiled" > /dev/null || { failures=$((failures + 1)); continue; }
+    python3 vm.py "$plain" > "$work/$name.plain.out" 2> "$work/$name.plain.steps"
+    python3 vm.py "$profiled" > "$work/$name.profiled.out" 2> "$work/$name.profiled.steps"
+    if ! cmp -s "$work/$name.plain.out" "$work/$name.profiled.out"; then
+        echo "$name: output changes with --profile-use"
+        failures=$((failures + 1))
+    fi
+    echo "$name: $(cat "$work/$name.plain.steps") -> $(cat "$work/$name.profiled.steps")"
+done
+
+echo "== peak memory on a generated class of $subroutines subroutines"
+mkdir -p "$work/whole" "$work/bounded"
+python3 generate.py "$subroutines" > "$work/whole/Big.jack"
+cp "$work/whole/Big.jack" "$work/bounded/"
+echo "Big.jack: $(wc -c < "$work/whole/Big.jack") bytes"
+for mode in "" "--bounded-memory" "--source-map" "--bounded-memory --source-map"; do
+    directory="$work/whole"
+    case "$mode" in
+        --bounded-memory*) directory="$work/bounded" ;;
+    esac
+    if ! statistics=$("$jc" --stats $mode "$directory"); then
+        echo "${mode:-default}: $statistics"
+        failures=$((failures + 1))
+        continue
+    fi
+    echo "${mode:-default}: ${statistics##*peak RSS so far }"
+done
+
+if ! cmp -s "$work/whole/Big.vm" "$work/bounded/Big.vm"; then
+    echo "--bounded-memory changes the output"
+    failures=$((failures + 1))
+fi
+
+# the first line of a map names the source file, which is in another directory for each mode
+if ! cmp -s <(tail -n +2 "$work/whole/Big.vm.map") <(tail -n +2 "$work/bounded/Big.vm.map"); then
+    echo "--bounded-memory changes the source map"
+    failures=$((failures + 1))
+fi
+
+[ $failures -eq 0 ]
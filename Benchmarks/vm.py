@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+# runs the .vm files of a program from Main.main with a stub of the OS classes, prints what the program printed
+# and a line of statistics to stderr. With PROFILE set, writes the counts --profile-use reads to that file.
+# usage: vm.py directory
+import glob
+import os
+import sys
+
+
+def word(value):
+    value &= 0xFFFF
+    return value - 0x10000 if value & 0x8000 else value
+
+
+class VM:
+    def __init__(self, paths):
+        self.code = []
+        self.functions = {}
+        self.labels = {}
+        for path in paths:
+            function = None
+            for line in open(path):
+                parts = line.split('//')[0].split()
+                if not parts:
+                    continue
+                if parts[0] == 'function':
+                    function = parts[1]
+                    self.functions[function] = len(self.code)
+                elif parts[0] == 'label':
+                    self.labels[(function, parts[1])] = len(self.code)
+                self.code.append((parts, function))
+
+        # without a profile the compiler emits one if-goto per if and while statement in source order, jumping
+        # when the condition is false, so the if-gotos number the statements the way --profile-use expects
+        self.ordinals = {}
+        counts = {}
+        for i, (parts, function) in enumerate(self.code):
+            if parts[0] == 'if-goto':
+                self.ordinals[i] = counts.get(function, 0)
+                counts[function] = self.ordinals[i] + 1
+
+        self.ram = [0] * 32768
+        self.statics = {}
+        self.heap = 2048
+        self.output = []
+        self.steps = 0
+        self.calls = 0
+        self.function_counts = {}
+        self.branch_counts = {}
+
+    def allocate(self, size):
+        address = self.heap
+        self.heap += max(size, 1)
+        return address
+
+    def builtin(self, name, arguments):
+        ram = self.ram
+        if name == 'Math.multiply':
+            return word(arguments[0] * arguments[1])
+        if name == 'Math.divide':
+            a, b = arguments
+            quotient = abs(a) // abs(b)
+            return word(quotient if (a < 0) == (b < 0) else -quotient)
+        if name in ('Memory.alloc', 'Array.new'):
+            return self.allocate(arguments[0])
+        if name in ('Memory.deAlloc', 'Array.dispose'):
+            return 0
+        if name == 'Memory.peek':
+            return ram[arguments[0]]
+        if name == 'Memory.poke':
+            ram[arguments[0]] = arguments[1]
+            return 0
+        if name == 'String.new':
+            address = self.allocate(arguments[0] + 2)
+            ram[address] = 0
+            return address
+        if name == 'String.appendChar':
+            address, character = arguments
+            ram[address + 2 + ram[address]] = character
+            ram[address] += 1
+            return address
+        if name == 'Output.printInt':
+            self.output.append(str(arguments[0]))
+            return 0
+        if name == 'Output.printChar':
+            self.output.append(chr(arguments[0]))
+            return 0
+        if name == 'Output.printString':
+            address = arguments[0]
+            self.output.append(''.join(chr(ram[address + 2 + i]) for i in range(ram[address])))
+            return 0
+        if name == 'Output.println':
+            self.output.append('\n')
+            return 0
+        if name == 'Sys.halt':
+            raise SystemExit
+        raise Exception('unknown subroutine ' + name)
+
+    def address(self, segment, index):
+        ram = self.ram
+        if segment == 'local':
+            return ram[1] + index
+        if segment == 'argument':
+            return ram[2] + index
+        if segment == 'this':
+            return ram[3] + index
+        if segment == 'that':
+            return ram[4] + index
+        if segment == 'pointer':
+            return 3 + index
+        if segment == 'temp':
+            return 5 + index
+        raise Exception('unknown segment ' + segment)
+
+    def run(self, entry='Main.main', limit=100000000):
+        ram = self.ram
+        code = self.code
+        # Main.main is called from a frame at 256 that returns to address 0
+        ram[0] = 261
+        ram[1] = 261
+        ram[2] = 256
+        pc = self.functions[entry]
+        operations = {
+            'add': lambda a, b: word(a + b), 'sub': lambda a, b: word(a - b),
+            'and': lambda a, b: a & b, 'or': lambda a, b: a | b,
+            'eq': lambda a, b: -1 if a == b else 0, 'gt': lambda a, b: -1 if a > b else 0,
+            'lt': lambda a, b: -1 if a < b else 0,
+        }
+        while True:
+            self.steps += 1
+            if self.steps > limit:
+                raise Exception('too many steps')
+            parts, function = code[pc]
+            pc += 1
+            command = parts[0]
+            if command == 'push':
+                segment, index = parts[1], int(parts[2])
+                if segment == 'constant':
+                    value = index
+                elif segment == 'static':
+                    value = self.statics.get((function.split('.')[0], index), 0)
+                else:
+                    value = ram[self.address(segment, index)]
+                ram[ram[0]] = value
+                ram[0] += 1
+            elif command == 'pop':
+                segment, index = parts[1], int(parts[2])
+                ram[0] -= 1
+                value = ram[ram[0]]
+                if segment == 'static':
+                    self.statics[(function.split('.')[0], index)] = value
+                else:
+                    ram[self.address(segment, index)] = value
+            elif command in operations:
+                ram[0] -= 1
+                ram[ram[0] - 1] = operations[command](ram[ram[0] - 1], ram[ram[0]])
+            elif command == 'neg':
+                ram[ram[0] - 1] = word(-ram[ram[0] - 1])
+            elif command == 'not':
+                ram[ram[0] - 1] = word(~ram[ram[0] - 1])
+            elif command == 'label':
+                pass
+            elif command == 'goto':
+                pc = self.labels[(function, parts[1])]
+            elif command == 'if-goto':
+                ram[0] -= 1
+                counts = self.branch_counts.setdefault((function, self.ordinals[pc - 1]), [0, 0])
+                if ram[ram[0]]:
+                    pc = self.labels[(function, parts[1])]
+                    counts[1] += 1
+                else:
+                    counts[0] += 1
+            elif command == 'function':
+                self.function_counts[function] = self.function_counts.get(function, 0) + 1
+                for i in range(int(parts[2])):
+                    ram[ram[0]] = 0
+                    ram[0] += 1
+            elif command == 'call':
+                name, count = parts[1], int(parts[2])
+                self.calls += 1
+                if name not in self.functions:
+                    arguments = ram[ram[0] - count:ram[0]]
+                    ram[0] -= count
+                    ram[ram[0]] = self.builtin(name, arguments)
+                    ram[0] += 1
+                    continue
+                frame = ram[0]
+                ram[frame:frame + 5] = [pc, ram[1], ram[2], ram[3], ram[4]]
+                ram[2] = frame - count
+                ram[0] = frame + 5
+                ram[1] = frame + 5
+                pc = self.functions[name]
+            elif command == 'return':
+                frame = ram[1]
+                returnAddress = ram[frame - 5]
+                ram[ram[2]] = ram[ram[0] - 1]
+                ram[0] = ram[2] + 1
+                ram[4], ram[3], ram[2], ram[1] = ram[frame - 1], ram[frame - 2], ram[frame - 3], ram[frame - 4]
+                if returnAddress == 0 and frame == 261:
+                    return
+                pc = returnAddress
+            else:
+                raise Exception('unknown command ' + command)
+
+
+if __name__ == '__main__':
+    vm = VM(sorted(glob.glob(os.path.join(sys.argv[1], '*.vm'))))
+    try:
+        vm.run()
+    except SystemExit:
+        pass
+    print(''.join(vm.output))
+    print(f'steps {vm.steps} calls {vm.calls} instructions {len(vm.code)}', file=sys.stderr)
+
+    if os.environ.get('PROFILE'):
+        with open(os.environ['PROFILE'], 'w') as profile:
+            for name, count in sorted(vm.function_counts.items()):
+                profile.write(f'function {name} {count}\n')
+            for (name, ordinal), (taken, notTaken) in sorted(vm.branch_counts.items()):
+                profile.write(f'branch {name} {ordinal} {taken} {notTaken}\n')
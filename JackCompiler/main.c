@@ -6,13 +6,35 @@
 //  Copyright © 2017 Stanford Stevens. All rights reserved.
 //
 
+//for fopencookie, which streams lazily made tokens to the parser
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <string.h>
 #include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__)) && !defined(JACK_SCALAR_LEXER)
+#include <immintrin.h>
+#define JACK_VECTOR_LEXER
+#endif
 
 #define isSymbol(c) c == '{' || c == '}' || c == '(' || c == ')' || c == '[' || c == ']' || c == '.' || c == ',' || c == ';' || c == '+' || c == '-' || c == '*' || c == '/' || c == '&' || c == '|' || c == '<' || c == '>' || c == '=' || c == '~'
 
@@ -24,6 +46,12 @@ typedef enum {
     TokenTypeIdentifier
 } TokenType;
 
+typedef enum {
+    ArrayIndexExpression,
+    ArrayIndexConstant,
+    ArrayIndexVariable
+} ArrayIndexType;
+
 typedef struct Symbol {
     char *name;
     char *type;
@@ -31,6 +59,97 @@ typedef struct Symbol {
     int scope;
 } Symbol;
 
+typedef enum {
+    CommandPush,
+    CommandPop,
+    CommandArithmetic,
+    CommandLabel,
+    CommandGoto,
+    CommandIfGoto,
+    CommandFunction,
+    CommandCall,
+    CommandReturn
+} CommandType;
+
+typedef enum {
+    SegmentConstant,
+    SegmentArgument,
+    SegmentLocal,
+    SegmentStatic,
+    SegmentThis,
+    SegmentThat,
+    SegmentPointer,
+    SegmentTemp
+} Segment;
+
+typedef struct Instruction {
+    CommandType type;
+    char *text; //the line as it was emitted, without the local count for 'function'
+    Segment segment;
+    int index; //the push/pop index, label number or function local count
+    int line; //source position of the statement it was compiled from, 0 without source maps
+    int column;
+} Instruction;
+
+typedef struct Block {
+    size_t first;
+    size_t end;
+    int successors[2];
+    int number_of_successors;
+} Block;
+
+typedef struct Subroutine {
+    Instruction *instructions;
+    size_t number_of_instructions;
+    size_t length_of_instructions;
+    
+    Block *blocks;
+    int number_of_blocks;
+    int *labelBlocks;
+    int number_of_labels;
+    
+    int declaration; //index into class_subroutines
+    char *buffer; //what the instruction texts point into, when the subroutine owns it
+} Subroutine;
+
+typedef struct ThatPointer {
+    Symbol *base;
+    Symbol *index; //NULL when pointer 1 holds the base address itself
+    int isValid;
+} ThatPointer;
+
+typedef enum {
+    ExpressionConstant,
+    ExpressionTrue,
+    ExpressionThis,
+    ExpressionString,
+    ExpressionVariable,
+    ExpressionArray,
+    ExpressionCall,
+    ExpressionUnary,
+    ExpressionChain
+} ExpressionType;
+
+//an expression is parsed whole before any of it is written, so operands can be reordered and repeated ones reused
+typedef struct Expression {
+    ExpressionType type;
+    int value; //integer constant, or constant array index
+    char *text; //string constant with its quotes, or the called subroutine as 'Class.name'
+    Symbol *symbol; //variable, or array
+    Symbol *indexSymbol; //variable array index
+    struct Expression **operands; //array index expression, call arguments with the object first, or unary and chain operands
+    int number_of_operands;
+    char **operations; //operations[i] combines the chain before operands[i + 1] with it, or applies to the unary operand
+    char *isSwapped; //chain steps that evaluate operands[i + 1] before the chain before it
+    int need; //stack slots needed to evaluate it
+    int isPure; //calls nothing with side effects and allocates nothing
+    int isMethodCall;
+    struct Expression *original; //the first equal expression, which keeps the value they share
+    int uses; //for an original, the number of equal expressions
+    int temporary; //for an original, the local its value is kept in once it has been written, or -1
+    uint32_t hash; //equal expressions have equal hashes
+} Expression;
+
 size_t *number_of_class_symbols;
 size_t *length_of_class_symbols;
 Symbol **class_symbols;
@@ -39,9 +158,124 @@ size_t *number_of_sub_symbols;
 size_t *length_of_sub_symbols;
 Symbol **sub_symbols;
 
+typedef struct SubroutineDeclaration {
+    char *name;
+    char *kind;
+    char *returnType;
+    int number_of_parameters;
+    char **parameterTypes;
+    int isPure; //stores only into its own frame and calls only pure subroutines
+} SubroutineDeclaration;
+
+typedef struct CompilerStatistics {
+    size_t instructions;
+    int declaredLocals;
+    int allocatedLocals;
+} CompilerStatistics;
+
+typedef struct CompilerOptions {
+    int optimize;
+    int convertTailCalls;
+    int stripUnusedLabels;
+    int useInterfaces;
+    char *referencePath;
+    int showStatistics;
+    int verifyTokenizer;
+    int writeSourceMaps;
+    char *profilePath;
+    int boundMemory;
+} CompilerOptions;
+
+//where a token starts in the token file and in the source, recorded for source maps and to find where an error is
+typedef struct TokenPosition {
+    size_t offset;
+    int line;
+    int column;
+} TokenPosition;
+
+//where and why tokenizing stopped, message is NULL when the whole source was tokenized
+typedef struct LexicalError {
+    const char *message;
+    int line;
+    int column;
+} LexicalError;
+
+SubroutineDeclaration *class_subroutines;
+size_t number_of_class_subroutines;
+
+char *currentInputPath;
+
+//the token stream being parsed and the source it was made from, set while a class is parsed
+FILE *currentTokenFile;
+const char *currentSource;
+size_t currentSourceLength;
+
+//the subroutine being compiled when its output is buffered for the subroutine passes
+FILE *subroutineFile;
+char *subroutineBuffer;
+//with a profile, the subroutines of the class are kept and written together once the whole class is compiled
+Subroutine *class_bodies;
+size_t number_of_class_bodies;
 char *currentClass;
+char *currentSubroutine;
 int labelNumber;
 
+TokenPosition *token_positions;
+size_t number_of_token_positions;
+size_t length_of_token_positions;
+
+//a lexical error met while tokenizing lazily, reported once the parser has read the tokens before it
+LexicalError pendingLexicalError;
+
+//maps the instructions of the output file to source positions, each entry holding until the next one
+FILE *sourceMapFile;
+int sourceMapLine;
+int sourceMapColumn;
+
+CompilerOptions options;
+CompilerStatistics statistics;
+
+jmp_buf *errorJump;
+
+#pragma mark Errors
+
+int findTokenPosition(size_t offset, int *line, int *column);
+
+//reports a compile error and stops compiling the file, unwinding to errorJump when one is set instead of exiting.
+//While a class is parsed the error is prefixed with the source position of the token read last.
+void compileError(const char *format, ...) {
+    int line;
+    int column;
+    if (currentTokenFile && findTokenPosition(ftell(currentTokenFile), &line, &column)) {
+        printf("%s:%d:%d: ", currentInputPath, line, column);
+    }
+    
+    va_list arguments;
+    va_start(arguments, format);
+    vprintf(format, arguments);
+    va_end(arguments);
+    
+    if (errorJump) {
+        longjmp(*errorJump, 1);
+    }
+    exit(1);
+}
+
+ThatPointer thatPointer;
+
+//every nested term takes a few stack frames, so absurdly deep expressions are rejected instead of overflowing the stack
+const int maximumTermDepth = 2000;
+int termDepth;
+
+//the nodes of the expression being compiled, freed together once it is written
+Expression **expression_nodes;
+size_t number_of_expression_nodes;
+size_t length_of_expression_nodes;
+
+//locals past the declared ones keep values an expression uses more than once
+int firstTemporaryLocal;
+int number_of_temporary_locals;
+
 #pragma mark Symbol Table
 
 void freeSymbolTable(Symbol **symbolTable, size_t *numberOfSymbols) {
@@ -60,7 +294,7 @@ void freeSymbolTable(Symbol **symbolTable, size_t *numberOfSymbols) {
 
 Symbol **add_symbol(Symbol **symbolTable, Symbol *symbol) {
     size_t *number_of_symbols = (symbolTable == class_symbols) ? number_of_class_symbols : number_of_sub_symbols;
-    size_t *length_of_symbols = (symbolTable == class_symbols) ? length_of_class_symbols : length_of_class_symbols;
+    size_t *length_of_symbols = (symbolTable == class_symbols) ? length_of_class_symbols : length_of_sub_symbols;
     
     int scope = 0;
     for (int i = (int)*number_of_symbols - 1; i >= 0; i--) {
@@ -86,11 +320,7 @@ Symbol **add_symbol(Symbol **symbolTable, Symbol *symbol) {
 
 Symbol **initialize_symbol_table(size_t *length_of_symbols, size_t *number_of_symbols) {
     int initial_symbol_count = 10;
-    Symbol **symbolTable = malloc(initial_symbol_count*sizeof(Symbol));
-    
-    for (int i = 0; i < initial_symbol_count; i++) {
-        symbolTable[i] = malloc(sizeof(Symbol *));
-    }
+    Symbol **symbolTable = malloc(initial_symbol_count*sizeof(Symbol *));
     
     *length_of_symbols = initial_symbol_count;
     *number_of_symbols = 0;
@@ -136,7 +366,7 @@ char *trim_whitespace(char *string) {
 }
 
 char *pathWithInputPath(char *inputPath, char *extension) {
-    char *path = malloc(strlen(inputPath) + 1);
+    char *path = malloc(strlen(inputPath) + strlen(extension) + 1);
     strcpy(path, inputPath);
     char *loc = strrchr(path, '.');
     *(loc) = 0;
@@ -145,9 +375,14 @@ char *pathWithInputPath(char *inputPath, char *extension) {
     return path;
 }
 
-void uniqueLabel(char *label) {
-    sprintf(label, "LABEL%d", labelNumber);
-    labelNumber++;
+//labels are numbered per subroutine, so output does not depend on the order files are compiled in
+int uniqueLabel() {
+    return labelNumber++;
+}
+
+int labelWithName(char *name) {
+    char *separator = strchr(name, '$');
+    return separator ? atoi(separator + 2) : -1;
 }
 
 #pragma mark File Reading
@@ -160,17 +395,246 @@ int is_jack_file(const char *file) {
     return (!strcmp(extension, "jack")) ? 1 : 0;
 }
 
+//reads one token per line, leaving an empty token at the end of the file
 char *fgets_nl(char *buffer, int size, FILE *file) {
-    buffer = fgets(buffer, size, file);
-    if (buffer == NULL) { return NULL; }
+    if (fgets(buffer, size, file) == NULL) {
+        buffer[0] = '\0';
+        if (pendingLexicalError.message) {
+            currentTokenFile = NULL; //the lexical error has a position of its own
+            compileError("%s:%d:%d: %s\n", currentInputPath, pendingLexicalError.line, pendingLexicalError.column, pendingLexicalError.message);
+        }
+        return NULL;
+    }
     
     char *pos = strchr(buffer, '\n');
     if (pos != NULL) {
         *pos = '\0';
+    } else if (!feof(file)) {
+        compileError("Token '%.16s...' is too long!\n", buffer);
     }
     return buffer;
 }
 
+char *readWholeFile(char *path, size_t *length) {
+    *length = 0;
+    FILE *file = fopen(path, "r");
+    if (!file) { return NULL; }
+    
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    
+    char *contents = malloc(size + 1);
+    *length = fread(contents, 1, size, file);
+    contents[*length] = 0;
+    fclose(file);
+    
+    return contents;
+}
+
+struct timespec modificationTime(struct stat *file_stat) {
+#ifdef __APPLE__
+    return file_stat->st_mtimespec;
+#else
+    return file_stat->st_mtim;
+#endif
+}
+
+//maps the file instead of reading it, so the pages that have been tokenized can be dropped again
+char *mapWholeFile(char *path, size_t *length) {
+    static char emptyFile[1];
+    
+    *length = 0;
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0) { return NULL; }
+    
+    struct stat status;
+    if (fstat(descriptor, &status) || status.st_size == 0) {
+        close(descriptor);
+        return emptyFile;
+    }
+    
+    char *contents = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (contents == MAP_FAILED) { return NULL; }
+    
+    *length = status.st_size;
+    return contents;
+}
+
+#pragma mark Output Files
+
+//an output written under a temporary name, which replaces the real file once the build has finished
+typedef struct PendingOutput {
+    char *path;
+    char *temporaryPath;
+    FILE *file; //NULL once the output has been written completely
+} PendingOutput;
+
+PendingOutput *pending_outputs;
+size_t number_of_pending_outputs;
+size_t length_of_pending_outputs;
+
+//the temporary file is made in the directory of path, so renaming it over path cannot cross file systems
+//and no two compiles writing the same output ever share one
+FILE *createTemporaryFile(const char *path, char **temporaryPath) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    size_t directoryLength = name - path;
+    
+    *temporaryPath = malloc(strlen(path) + strlen(".XXXXXX") + 2);
+    memcpy(*temporaryPath, path, directoryLength);
+    sprintf(*temporaryPath + directoryLength, ".%s.XXXXXX", name);
+    
+    int descriptor = mkstemp(*temporaryPath);
+    if (descriptor < 0) {
+        free(*temporaryPath);
+        *temporaryPath = NULL;
+        return NULL;
+    }
+    
+    //mkstemp only lets the owner read the file, give it the permissions fopen would have
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(descriptor, 0666 & ~mask);
+    
+    FILE *file = fdopen(descriptor, "w");
+    if (!file) {
+        close(descriptor);
+        remove(*temporaryPath);
+        free(*temporaryPath);
+        *temporaryPath = NULL;
+    }
+    return file;
+}
+
+//opens an output that is only moved over path by commitOutputs
+FILE *openOutput(const char *path) {
+    char *temporaryPath;
+    FILE *file = createTemporaryFile(path, &temporaryPath);
+    if (!file) {
+        compileError("Could not create '%s'!\n", path);
+    }
+    
+    if (number_of_pending_outputs == length_of_pending_outputs) {
+        length_of_pending_outputs = length_of_pending_outputs ? length_of_pending_outputs * 2 : 8;
+        pending_outputs = realloc(pending_outputs, length_of_pending_outputs * sizeof(PendingOutput));
+    }
+    pending_outputs[number_of_pending_outputs++] = (PendingOutput){strdup(path), temporaryPath, file};
+    return file;
+}
+
+void removePendingOutput(size_t index) {
+    PendingOutput *output = &pending_outputs[index];
+    if (output->file) {
+        fclose(output->file);
+    }
+    remove(output->temporaryPath);
+    free(output->temporaryPath);
+    free(output->path);
+    
+    pending_outputs[index] = pending_outputs[--number_of_pending_outputs];
+}
+
+//marks an output as complete, one that could not be written in full is dropped so the old file stays in place
+void closeOutput(FILE *file) {
+    for (size_t i = 0; i < number_of_pending_outputs; i++) {
+        PendingOutput *output = &pending_outputs[i];
+        if (output->file != file) { continue; }
+        
+        output->file = NULL;
+        int failed = ferror(file);
+        if (fclose(file) || failed) {
+            char *path = strdup(output->path);
+            removePendingOutput(i);
+            compileError("Could not write '%s'!\n", path);
+        }
+        return;
+    }
+}
+
+int hasSameContents(const char *path, const char *otherPath) {
+    FILE *file = fopen(path, "rb");
+    if (!file) { return 0; }
+    FILE *otherFile = fopen(otherPath, "rb");
+    if (!otherFile) {
+        fclose(file);
+        return 0;
+    }
+    
+    int isSame = 1;
+    char buffer[4096];
+    char otherBuffer[4096];
+    while (isSame) {
+        size_t length = fread(buffer, 1, sizeof(buffer), file);
+        size_t otherLength = fread(otherBuffer, 1, sizeof(otherBuffer), otherFile);
+        isSame = length == otherLength && !memcmp(buffer, otherBuffer, length);
+        if (length < sizeof(buffer)) { break; }
+    }
+    
+    fclose(file);
+    fclose(otherFile);
+    return isSame;
+}
+
+//moves every complete output over its file, unless the file already has the same bytes, so unchanged files keep their mtime
+//outputs of a compile that failed are dropped. everything is flushed to disk with one sync before the first rename,
+//so after a crash each file holds either its old or its new contents
+void commitOutputs() {
+    size_t i = 0;
+    while (i < number_of_pending_outputs) {
+        PendingOutput *output = &pending_outputs[i];
+        if (output->file || hasSameContents(output->path, output->temporaryPath)) {
+            removePendingOutput(i);
+        } else {
+            i++;
+        }
+    }
+    
+    if (number_of_pending_outputs) {
+#ifdef __linux__
+        //one syncfs for each file system the outputs are on, the files of a directory are usually all on one
+        dev_t *devices = malloc(number_of_pending_outputs * sizeof(dev_t));
+        size_t number_of_devices = 0;
+        for (i = 0; i < number_of_pending_outputs; i++) {
+            struct stat file_stat;
+            if (stat(pending_outputs[i].temporaryPath, &file_stat)) { continue; }
+            
+            size_t j = 0;
+            while (j < number_of_devices && devices[j] != file_stat.st_dev) {
+                j++;
+            }
+            if (j < number_of_devices) { continue; }
+            devices[number_of_devices++] = file_stat.st_dev;
+            
+            int descriptor = open(pending_outputs[i].temporaryPath, O_RDONLY);
+            if (descriptor >= 0) {
+                syncfs(descriptor);
+                close(descriptor);
+            }
+        }
+        free(devices);
+#else
+        sync();
+#endif
+    }
+    
+    for (i = 0; i < number_of_pending_outputs; i++) {
+        PendingOutput *output = &pending_outputs[i];
+        if (rename(output->temporaryPath, output->path)) {
+            printf("Could not replace '%s'!\n", output->path);
+            remove(output->temporaryPath);
+        }
+        free(output->temporaryPath);
+        free(output->path);
+    }
+    
+    free(pending_outputs);
+    pending_outputs = NULL;
+    number_of_pending_outputs = 0;
+    length_of_pending_outputs = 0;
+}
+
 #pragma mark File Printing
 
 void writeSymbol(FILE *outputFile, char *action, Symbol *symbol) {
@@ -197,853 +661,4115 @@ TokenType tokenType(char *token) {
     }
 }
 
-#pragma mark Compile Functions
+//the value of an integer constant token, which the language limits to 0...32767
+int integerConstant(char *token) {
+    long value = 0;
+    for (char *digit = token; *digit; digit++) {
+        if (*digit < '0' || *digit > '9') {
+            compileError("Integer constant '%s' is not a number!\n", token);
+        }
+        value = value * 10 + (*digit - '0');
+        if (value > 32767) {
+            compileError("Integer constant '%s' is larger than 32767!\n", token);
+        }
+    }
+    return (int)value;
+}
 
-int compileVarBody(FILE *inputFile, FILE *outputFile, Symbol *newSymbol, Symbol **symbolTable) {
-    char line[256];
+void writeNumber(FILE *outputFile, int number) {
+    if (number < 0) {
+        fputc('-', outputFile);
+    }
+    unsigned magnitude = number < 0 ? 0u - (unsigned)number : (unsigned)number;
     
-    fgets_nl(line, sizeof(line), inputFile);
-    TokenType lineType = tokenType(line);
-    if (lineType == TokenTypeIdentifier || !strcmp(line, "int") || !strcmp(line, "char") || !strcmp(line, "boolean")) {
-        newSymbol->type = malloc(strlen(line));
-        strcpy(newSymbol->type, line);
-    } else {
-        printf("Var declaration does not have a valid type!\n");
-        exit(1);
+    char digits[12];
+    int length = 0;
+    do {
+        digits[length++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+    
+    while (length) {
+        fputc(digits[--length], outputFile);
     }
+}
+
+//marks the instructions compiled from the next token on with its source position, read back by readSubroutine
+void writeSourcePosition(FILE *inputFile, FILE *outputFile) {
+    if (!options.writeSourceMaps) { return; }
     
-    int variableCount = 0;
-    while (1) {
-        fgets_nl(line, sizeof(line), inputFile);
-        if (tokenType(line) == TokenTypeIdentifier) {
-            newSymbol->name = malloc(strlen(line));
-            strcpy(newSymbol->name, line);
-        } else {
-            printf("Var name must be of token type 'identifier'!\n");
-            exit(1);
-        }
-        
-        variableCount++;
-        
-        fgets_nl(line, sizeof(line), inputFile);
-        if (!strcmp(line, ";")) {
-            break;
-        } else if (!strcmp(line, ",")) {
-            char *kind = newSymbol->kind;
-            char *type = newSymbol->type;
-            
-            newSymbol = malloc(sizeof(Symbol));
-            newSymbol->kind = malloc(strlen(kind));
-            strcpy(newSymbol->kind, kind);
-            newSymbol->type = malloc(strlen(type));
-            strcpy(newSymbol->type, type);
-            
-            add_symbol(symbolTable, newSymbol);
+    //a lazy token stream may not have made the next token yet when the stdio buffer has just run out, peeking makes it
+    int next = getc(inputFile);
+    if (next != EOF) {
+        ungetc(next, inputFile);
+    }
+    if (!number_of_token_positions) { return; }
+    
+    size_t offset = ftell(inputFile);
+    size_t low = 0;
+    size_t high = number_of_token_positions - 1;
+    while (low < high) {
+        size_t middle = (low + high + 1) / 2;
+        if (token_positions[middle].offset <= offset) {
+            low = middle;
         } else {
-            printf("Expected ';' at end of line of var declaration(s)!\n");
-            exit(1);
+            high = middle - 1;
         }
     }
-    
-    return variableCount;
+    fprintf(outputFile, "#%d %d\n", token_positions[low].line, token_positions[low].column);
 }
 
-void compileClassVarDeclaration(char *varType, FILE *inputFile, FILE *outputFile) {
-    Symbol *newSymbol = malloc(sizeof(Symbol));
-    newSymbol->kind = malloc(strlen(varType));
-    strcpy(newSymbol->kind, varType);
-    class_symbols = add_symbol(class_symbols, newSymbol);
+void writeSubroutineLabel(FILE *outputFile, char *command, char *subroutineName, int label) {
+    fputs(command, outputFile);
+    fputc(' ', outputFile);
+    fputs(subroutineName, outputFile);
+    fputs("$L", outputFile);
+    writeNumber(outputFile, label);
+    fputc('\n', outputFile);
+}
+
+void writeLabel(FILE *outputFile, char *command, int label) {
+    writeSubroutineLabel(outputFile, command, currentSubroutine, label);
+}
+
+#pragma mark Array Access
+
+//pointer 1 is only tracked within a basic block, so every label must invalidate it
+void invalidateThatPointer() {
+    thatPointer.isValid = 0;
+}
+
+//locals and arguments can only change through 'let', fields and statics can also change inside a call
+int isCallStable(Symbol *symbol) {
+    return !strcmp(symbol->kind, "var") || !strcmp(symbol->kind, "argument");
+}
+
+void invalidateThatPointerForSymbol(Symbol *symbol) {
+    if (thatPointer.base == symbol || thatPointer.index == symbol) {
+        invalidateThatPointer();
+    }
+}
+
+void invalidateThatPointerAfterCall() {
+    if (!thatPointer.isValid) { return; }
     
-    compileVarBody(inputFile, outputFile, newSymbol, class_symbols);
+    if (!isCallStable(thatPointer.base) || (thatPointer.index && !isCallStable(thatPointer.index))) {
+        invalidateThatPointer();
+    }
 }
 
-int compileVarDeclaration(FILE *inputFile, FILE *outputFile) {
-    Symbol *newSymbol = malloc(sizeof(Symbol));
-    char *kind = "var";
-    newSymbol->kind = malloc(strlen(kind));
-    strcpy(newSymbol->kind, kind);
-    sub_symbols = add_symbol(sub_symbols, newSymbol);
+void writeThatPointer(FILE *outputFile, Symbol *base, Symbol *index) {
+    if (thatPointer.isValid && thatPointer.base == base && thatPointer.index == index) {
+        return; //already pointing at base + index
+    }
+    
+    writeSymbol(outputFile, "push", base);
+    if (index) {
+        writeSymbol(outputFile, "push", index);
+        fputs("add\n", outputFile);
+    }
+    fputs("pop pointer 1\n", outputFile);
     
-    return compileVarBody(inputFile, outputFile, newSymbol, sub_symbols);
+    thatPointer.base = base;
+    thatPointer.index = index;
+    thatPointer.isValid = 1;
 }
 
-void compileParameterList(FILE *inputFile, FILE *outputFile) {
+//consumes the index and its ']' when it is a single integer constant or variable, otherwise consumes nothing
+ArrayIndexType scanArrayIndex(FILE *inputFile, int *constantIndex, Symbol **indexSymbol) {
     char line[256];
     
-    while (1) {
-        fpos_t pos;
-        fgetpos(inputFile, &pos);
-        
+    fpos_t pos;
+    fgetpos(inputFile, &pos);
+    
+    ArrayIndexType indexType = ArrayIndexExpression;
+    fgets_nl(line, sizeof(line), inputFile);
+    TokenType lineType = tokenType(line);
+    if (lineType == TokenTypeInteger) {
+        *constantIndex = integerConstant(line);
+        indexType = ArrayIndexConstant;
+    } else if (lineType == TokenTypeIdentifier) {
+        *indexSymbol = symbolWithName(line);
+        if (*indexSymbol) {
+            indexType = ArrayIndexVariable;
+        }
+    }
+    
+    if (indexType != ArrayIndexExpression) {
         fgets_nl(line, sizeof(line), inputFile);
-        if (!strcmp(line, ",")) {
-            //do nothing
-        } else if (!strcmp(line, ")")) {
-            fsetpos(inputFile, &pos);
-            break;
-        } else {
-            Symbol *newSymbol = malloc(sizeof(Symbol));
-            char *kind = "argument";
-            newSymbol->kind = malloc(strlen(kind));
-            strcpy(newSymbol->kind, kind);
-            sub_symbols = add_symbol(sub_symbols, newSymbol);
-            
-            TokenType lineType = tokenType(line);
-            if (lineType == TokenTypeIdentifier || !strcmp(line, "int") || !strcmp(line, "char") || !strcmp(line, "boolean") || !strcmp(line, "void")) {
-                newSymbol->type = malloc(strlen(line));
-                strcpy(newSymbol->type, line);
-            } else {
-                printf("Subroutine parameter does not have a valid type!\n");
-                exit(1);
-            }
-            
-            fgets_nl(line, sizeof(line), inputFile);
-            if (tokenType(line) == TokenTypeIdentifier) {
-                newSymbol->name = malloc(strlen(line));
-                strcpy(newSymbol->name, line);
-            } else {
-                printf("Subroutine parameter does not have a valid name!\n");
-                exit(1);
-            }
+        if (!strcmp(line, "]")) {
+            return indexType;
         }
     }
+    
+    *indexSymbol = NULL;
+    *constantIndex = 0;
+    fsetpos(inputFile, &pos);
+    return ArrayIndexExpression;
 }
 
-void compileExpression(FILE *inputFile, FILE *outputFile);
+#pragma mark Profiles
 
-int compileExpressionList(FILE *inputFile, FILE *outputFile) {
-    char line[256];
+//execution counts from VM runs, read by --profile-use from lines of
+//  function <Class.name> <calls>
+//  branch <Class.name> <ordinal> <taken> <notTaken>
+//where ordinal numbers the if and while statements of a subroutine from 0 in source order, and taken counts the times the condition was true
+typedef struct FunctionProfile {
+    char *name;
+    unsigned long count;
+} FunctionProfile;
+
+typedef struct BranchProfile {
+    char *name;
+    int ordinal;
+    unsigned long taken;
+    unsigned long notTaken;
+} BranchProfile;
+
+FunctionProfile *function_profiles;
+size_t number_of_function_profiles;
+BranchProfile *branch_profiles;
+size_t number_of_branch_profiles;
+unsigned long maximumFunctionCount;
+int branchNumber; //the ordinal of the next if or while statement in the subroutine being compiled
+
+int compareFunctionProfiles(const void *first, const void *second) {
+    return strcmp(((const FunctionProfile *)first)->name, ((const FunctionProfile *)second)->name);
+}
+
+int compareBranchProfiles(const void *first, const void *second) {
+    const BranchProfile *firstBranch = first;
+    const BranchProfile *secondBranch = second;
+    int order = strcmp(firstBranch->name, secondBranch->name);
+    return order ? order : (firstBranch->ordinal > secondBranch->ordinal) - (firstBranch->ordinal < secondBranch->ordinal);
+}
+
+void loadProfile(char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        compileError("Could not open profile '%s'!\n", path);
+    }
     
-    int count = 0;
-    while (1) {
-        fpos_t pos;
-        fgetpos(inputFile, &pos);
+    size_t length_of_function_profiles = 0;
+    size_t length_of_branch_profiles = 0;
+    char *line = NULL;
+    size_t length = 0;
+    int lineNumber = 0;
+    while (getline(&line, &length, file) >= 0) {
+        lineNumber++;
         
-        fgets_nl(line, sizeof(line), inputFile);
-        if (!strcmp(line, ")")) {
-            fsetpos(inputFile, &pos);
-            break;
-        } else if (!strcmp(line, ",")) {
-            //do nothing
-        } else {
-            fsetpos(inputFile, &pos);
-            compileExpression(inputFile, outputFile);
-            count++;
+        char name[256];
+        int ordinal;
+        unsigned long count, taken, notTaken;
+        if (sscanf(line, "function %255s %lu", name, &count) == 2) {
+            if (number_of_function_profiles == length_of_function_profiles) {
+                length_of_function_profiles = length_of_function_profiles ? length_of_function_profiles * 2 : 64;
+                function_profiles = realloc(function_profiles, length_of_function_profiles * sizeof(FunctionProfile));
+            }
+            function_profiles[number_of_function_profiles++] = (FunctionProfile){strdup(name), count};
+            if (count > maximumFunctionCount) {
+                maximumFunctionCount = count;
+            }
+        } else if (sscanf(line, "branch %255s %d %lu %lu", name, &ordinal, &taken, &notTaken) == 4) {
+            if (number_of_branch_profiles == length_of_branch_profiles) {
+                length_of_branch_profiles = length_of_branch_profiles ? length_of_branch_profiles * 2 : 64;
+                branch_profiles = realloc(branch_profiles, length_of_branch_profiles * sizeof(BranchProfile));
+            }
+            branch_profiles[number_of_branch_profiles++] = (BranchProfile){strdup(name), ordinal, taken, notTaken};
+        } else if (line[strspn(line, " \t\r\n")]) {
+            compileError("%s:%d: Profile lines must be 'function <name> <count>' or 'branch <name> <ordinal> <taken> <not taken>'!\n", path, lineNumber);
         }
     }
+    free(line);
+    fclose(file);
     
-    return count;
+    if (number_of_function_profiles) {
+        qsort(function_profiles, number_of_function_profiles, sizeof(FunctionProfile), compareFunctionProfiles);
+    }
+    if (number_of_branch_profiles) {
+        qsort(branch_profiles, number_of_branch_profiles, sizeof(BranchProfile), compareBranchProfiles);
+    }
 }
 
-void compileSubroutineCall(FILE *inputFile, FILE *outputFile, int hasReturn) {
-    char line[256];
+unsigned long functionCount(char *subroutineName) {
+    if (!number_of_function_profiles) { return 0; }
     
-    fgets_nl(line, sizeof(line), inputFile);
-    if (tokenType(line) != TokenTypeIdentifier) {
-        printf("Expected identifier at beginning of subroutine call!\n");
-        exit(1);
-    }
+    char name[512];
+    snprintf(name, sizeof(name), "%s.%s", currentClass, subroutineName);
+    FunctionProfile key = {name, 0};
+    FunctionProfile *profile = bsearch(&key, function_profiles, number_of_function_profiles, sizeof(FunctionProfile), compareFunctionProfiles);
+    return profile ? profile->count : 0;
+}
+
+//takes the ordinal of the next if or while statement and returns its profile, NULL when it has none
+BranchProfile * _Nullable nextBranchProfile() {
+    int ordinal = branchNumber++;
+    if (!options.optimize || !number_of_branch_profiles) { return NULL; }
     
-    char *subFirst = malloc(strlen(line));
-    strcpy(subFirst, line);
+    char name[512];
+    snprintf(name, sizeof(name), "%s.%s", currentClass, currentSubroutine);
+    BranchProfile key = {name, ordinal, 0, 0};
+    return bsearch(&key, branch_profiles, number_of_branch_profiles, sizeof(BranchProfile), compareBranchProfiles);
+}
+
+//a function is hot when it ran at least 1/64 as often as the hottest function in the profile
+int isHot(unsigned long count) {
+    return count && count >= maximumFunctionCount / 64;
+}
+
+#pragma mark Subroutine Passes
+
+const char *segmentNames[] = {"constant", "argument", "local", "static", "this", "that", "pointer", "temp"};
+
+void addInstruction(Subroutine *subroutine, Instruction instruction) {
+    if (subroutine->number_of_instructions == subroutine->length_of_instructions) {
+        subroutine->length_of_instructions *= 2;
+        subroutine->instructions = realloc(subroutine->instructions, subroutine->length_of_instructions * sizeof(Instruction));
+    }
     
-    fgets_nl(line, sizeof(line), inputFile);
-    if (!strcmp(line, "(")) {
-        fputs("push pointer 0\n", outputFile);
-        int expressionCount = compileExpressionList(inputFile, outputFile) + 1;
+    subroutine->instructions[subroutine->number_of_instructions++] = instruction;
+}
 
-        fgets_nl(line, sizeof(line), inputFile);
-        if (strcmp(line, ")")) {
-            printf("Expected ')' to end expression list!\n");
-            exit(1);
+Instruction parseInstruction(char *line) {
+    Instruction instruction;
+    instruction.text = line;
+    instruction.segment = SegmentConstant;
+    instruction.index = 0;
+    if (!strncmp(line, "push ", 5) || !strncmp(line, "pop ", 4)) {
+        instruction.type = line[1] == 'u' ? CommandPush : CommandPop;
+        char *segment = strchr(line, ' ') + 1;
+        for (int i = 0; i < sizeof(segmentNames) / sizeof(segmentNames[0]); i++) {
+            size_t length = strlen(segmentNames[i]);
+            if (!strncmp(segment, segmentNames[i], length) && segment[length] == ' ') {
+                instruction.segment = i;
+                instruction.index = atoi(segment + length + 1);
+                break;
+            }
         }
-        
-        fprintf(outputFile, "call %s.%s %d\n", currentClass, subFirst, expressionCount);
-    } else if (!strcmp(line, ".")) {
-        Symbol *symbol = symbolWithName(subFirst);
-        int expressionCount = 0;
-        if (symbol) {
-            subFirst = symbol->type;
-            expressionCount = 1;
-            writeSymbol(outputFile, "push", symbol);
+    } else if (!strncmp(line, "label ", 6)) {
+        instruction.type = CommandLabel;
+        instruction.index = labelWithName(line);
+    } else if (!strncmp(line, "goto ", 5)) {
+        instruction.type = CommandGoto;
+        instruction.index = labelWithName(line);
+    } else if (!strncmp(line, "if-goto ", 8)) {
+        instruction.type = CommandIfGoto;
+        instruction.index = labelWithName(line);
+    } else if (!strncmp(line, "function ", 9)) {
+        instruction.type = CommandFunction;
+        char *count = strrchr(line, ' ');
+        instruction.index = atoi(count + 1);
+        *count = '\0';
+    } else if (!strncmp(line, "call ", 5)) {
+        instruction.type = CommandCall;
+    } else if (!strcmp(line, "return")) {
+        instruction.type = CommandReturn;
+    } else {
+        instruction.type = CommandArithmetic;
+    }
+    
+    return instruction;
+}
+
+//splits a buffered subroutine into instructions, the buffer is modified in place and must outlive them.
+//Lines starting with '#' are source positions that apply to the instructions after them.
+void readSubroutine(Subroutine *subroutine, char *buffer) {
+    subroutine->number_of_instructions = 0;
+    subroutine->length_of_instructions = 64;
+    subroutine->instructions = malloc(subroutine->length_of_instructions * sizeof(Instruction));
+    subroutine->number_of_labels = labelNumber;
+    subroutine->declaration = (int)number_of_class_subroutines - 1;
+    
+    int sourceLine = 0;
+    int sourceColumn = 0;
+    char *line = buffer;
+    while (*line) {
+        char *end = strchr(line, '\n');
+        if (end) {
+            *end = '\0';
         }
         
-        fgets_nl(line, sizeof(line), inputFile);
-        if (tokenType(line) != TokenTypeIdentifier) {
-            printf("Invalid subroutine name!\n");
-            exit(1);
+        if (line[0] == '#') {
+            char *column;
+            sourceLine = (int)strtol(line + 1, &column, 10);
+            sourceColumn = atoi(column);
+        } else {
+            Instruction instruction = parseInstruction(line);
+            instruction.line = sourceLine;
+            instruction.column = sourceColumn;
+            addInstruction(subroutine, instruction);
         }
         
-        char *subName = malloc(strlen(line));
-        strcpy(subName, line);
+        if (!end) { break; }
+        line = end + 1;
+    }
+    
+    //values an expression reuses are kept in locals past the declared ones, which the header has to count
+    if (!subroutine->number_of_instructions || subroutine->instructions[0].type != CommandFunction) { return; }
+    
+    Instruction *header = &subroutine->instructions[0];
+    for (size_t i = 1; i < subroutine->number_of_instructions; i++) {
+        Instruction *instruction = &subroutine->instructions[i];
+        if ((instruction->type == CommandPush || instruction->type == CommandPop) && instruction->segment == SegmentLocal && instruction->index >= header->index) {
+            header->index = instruction->index + 1;
+        }
+    }
+}
+
+int isJump(Instruction *instruction) {
+    return instruction->type == CommandGoto || instruction->type == CommandIfGoto;
+}
+
+//drops every instruction marked in isRemoved, keeping the rest in order
+void removeInstructions(Subroutine *subroutine, char *isRemoved) {
+    size_t count = 0;
+    for (size_t i = 0; i < subroutine->number_of_instructions; i++) {
+        if (!isRemoved[i]) {
+            subroutine->instructions[count++] = subroutine->instructions[i];
+        }
+    }
+    subroutine->number_of_instructions = count;
+}
+
+//splits the subroutine into basic blocks, block 0 being the entry right after the function header
+void buildBlocks(Subroutine *subroutine) {
+    Instruction *instructions = subroutine->instructions;
+    size_t number_of_instructions = subroutine->number_of_instructions;
+    
+    subroutine->number_of_blocks = 0;
+    subroutine->blocks = malloc((number_of_instructions + 1) * sizeof(Block));
+    free(subroutine->labelBlocks);
+    subroutine->labelBlocks = malloc((subroutine->number_of_labels + 1) * sizeof(int));
+    for (int i = 0; i < subroutine->number_of_labels; i++) {
+        subroutine->labelBlocks[i] = -1;
+    }
+    
+    for (size_t i = 1; i < number_of_instructions; i++) {
+        Instruction *previous = &instructions[i - 1];
+        int isLeader = i == 1 || instructions[i].type == CommandLabel || isJump(previous) || previous->type == CommandReturn;
+        if (isLeader) {
+            Block *block = &subroutine->blocks[subroutine->number_of_blocks++];
+            block->first = i;
+            block->number_of_successors = 0;
+        }
+        subroutine->blocks[subroutine->number_of_blocks - 1].end = i + 1;
         
-        fgets_nl(line, sizeof(line), inputFile);
-        if (!strcmp(line, "(")) {
-            expressionCount += compileExpressionList(inputFile, outputFile);
-            
-            fgets_nl(line, sizeof(line), inputFile);
-            if (strcmp(line, ")")) {
-                printf("Expected ')' to end expression list!\n");
-                exit(1);
+        int label = instructions[i].index;
+        if (instructions[i].type == CommandLabel && label >= 0 && label < subroutine->number_of_labels) {
+            subroutine->labelBlocks[label] = subroutine->number_of_blocks - 1;
+        }
+    }
+    
+    for (int i = 0; i < subroutine->number_of_blocks; i++) {
+        Block *block = &subroutine->blocks[i];
+        Instruction *last = &instructions[block->end - 1];
+        
+        if (isJump(last) && last->index >= 0 && last->index < subroutine->number_of_labels && subroutine->labelBlocks[last->index] >= 0) {
+            block->successors[block->number_of_successors++] = subroutine->labelBlocks[last->index];
+        }
+        if (last->type != CommandGoto && last->type != CommandReturn && i + 1 < subroutine->number_of_blocks) {
+            block->successors[block->number_of_successors++] = i + 1;
+        }
+    }
+}
+
+void freeBlocks(Subroutine *subroutine) {
+    free(subroutine->blocks);
+    subroutine->blocks = NULL;
+    subroutine->number_of_blocks = 0;
+}
+
+//removes blocks that cannot be reached from the entry
+void removeUnreachableBlocks(Subroutine *subroutine) {
+    buildBlocks(subroutine);
+    if (subroutine->number_of_blocks == 0) {
+        freeBlocks(subroutine);
+        return;
+    }
+    
+    char *isReachable = calloc(subroutine->number_of_blocks, 1);
+    int *stack = malloc(subroutine->number_of_blocks * sizeof(int));
+    int stackSize = 0;
+    
+    stack[stackSize++] = 0;
+    isReachable[0] = 1;
+    while (stackSize) {
+        Block *block = &subroutine->blocks[stack[--stackSize]];
+        for (int i = 0; i < block->number_of_successors; i++) {
+            int successor = block->successors[i];
+            if (!isReachable[successor]) {
+                isReachable[successor] = 1;
+                stack[stackSize++] = successor;
             }
-            
-            fprintf(outputFile, "call %s.%s %d\n", subFirst, subName, expressionCount);
-        } else {
-            printf("Invalid subroutine name!\n");
-            exit(1);
         }
-    } else {
-        printf("Expected '(' or '.' after subroutine call!\n");
-        exit(1);
     }
     
-    if (!hasReturn) {
-        fputs("pop temp 0\n", outputFile);
+    char *isRemoved = calloc(subroutine->number_of_instructions, 1);
+    for (int i = 0; i < subroutine->number_of_blocks; i++) {
+        if (isReachable[i]) { continue; }
+        
+        Block *block = &subroutine->blocks[i];
+        memset(isRemoved + block->first, 1, block->end - block->first);
     }
+    removeInstructions(subroutine, isRemoved);
+    
+    free(isRemoved);
+    free(stack);
+    free(isReachable);
+    freeBlocks(subroutine);
 }
 
-void compileTerm(FILE *inputFile, FILE *outputFile) {
-    char line[256];
+int finalJumpTarget(Subroutine *subroutine, int label, int *labelPositions, int *finalTargets) {
+    if (finalTargets[label] != -1) {
+        return finalTargets[label] == -2 ? label : finalTargets[label]; //-2 marks a cycle of gotos
+    }
+    finalTargets[label] = -2;
+    
+    int target = label;
+    size_t position = labelPositions[label];
+    while (position < subroutine->number_of_instructions && subroutine->instructions[position].type == CommandLabel) {
+        position++;
+    }
+    
+    Instruction *next = position < subroutine->number_of_instructions ? &subroutine->instructions[position] : NULL;
+    if (next && next->type == CommandGoto && next->index >= 0 && next->index < subroutine->number_of_labels && labelPositions[next->index] >= 0) {
+        target = finalJumpTarget(subroutine, next->index, labelPositions, finalTargets);
+    }
+    
+    finalTargets[label] = target;
+    return target;
+}
 
-    fpos_t initialTermPos;
-    fgetpos(inputFile, &initialTermPos);
+//retargets jumps that land on another goto, then removes jumps to the instruction that follows them anyway
+void simplifyJumps(Subroutine *subroutine) {
+    int number_of_labels = subroutine->number_of_labels;
+    int *labelPositions = malloc((number_of_labels + 1) * sizeof(int));
+    int *finalTargets = malloc((number_of_labels + 1) * sizeof(int));
+    for (int i = 0; i < number_of_labels; i++) {
+        labelPositions[i] = -1;
+        finalTargets[i] = -1;
+    }
     
-    fgets_nl(line, sizeof(line), inputFile);
-    TokenType termType = tokenType(line);
-    switch (termType) {
-        case TokenTypeString:
-            fprintf(outputFile, "push constant %lu\ncall String.new 1\n", strlen(line)-2); //ignore '"'
-            for (int i = 0; i < strlen(line) - 1; i++) {
-                char c = line[i];
-                if (c != '"') {
-                    fprintf(outputFile, "push constant %d\ncall String.appendChar 2\n", c);
-                }
+    for (size_t i = 0; i < subroutine->number_of_instructions; i++) {
+        Instruction *instruction = &subroutine->instructions[i];
+        if (instruction->type == CommandLabel && instruction->index >= 0 && instruction->index < number_of_labels) {
+            labelPositions[instruction->index] = (int)i;
+        }
+    }
+    
+    char *isRemoved = calloc(subroutine->number_of_instructions + 1, 1);
+    for (size_t i = 0; i < subroutine->number_of_instructions; i++) {
+        Instruction *instruction = &subroutine->instructions[i];
+        if (!isJump(instruction) || instruction->index < 0 || instruction->index >= number_of_labels || labelPositions[instruction->index] < 0) { continue; }
+        
+        instruction->index = finalJumpTarget(subroutine, instruction->index, labelPositions, finalTargets);
+        
+        size_t next = i + 1;
+        while (next < subroutine->number_of_instructions && subroutine->instructions[next].type == CommandLabel &&
+               subroutine->instructions[next].index != instruction->index) {
+            next++;
+        }
+        if (next < subroutine->number_of_instructions && subroutine->instructions[next].type == CommandLabel) {
+            if (instruction->type == CommandGoto) {
+                isRemoved[i] = 1;
+            } else {
+                //the condition still has to come off the stack
+                instruction->type = CommandPop;
+                instruction->segment = SegmentTemp;
+                instruction->index = 0;
             }
+        }
+    }
+    removeInstructions(subroutine, isRemoved);
+    
+    free(isRemoved);
+    free(finalTargets);
+    free(labelPositions);
+}
+
+//drops labels that no goto or if-goto refers to, merging the blocks on either side of them
+void removeUnusedLabels(Subroutine *subroutine) {
+    char *isLabelUsed = calloc(subroutine->number_of_labels + 1, 1);
+    for (size_t i = 0; i < subroutine->number_of_instructions; i++) {
+        Instruction *instruction = &subroutine->instructions[i];
+        if (isJump(instruction) && instruction->index >= 0 && instruction->index < subroutine->number_of_labels) {
+            isLabelUsed[instruction->index] = 1;
+        }
+    }
+    
+    char *isRemoved = calloc(subroutine->number_of_instructions + 1, 1);
+    for (size_t i = 0; i < subroutine->number_of_instructions; i++) {
+        Instruction *instruction = &subroutine->instructions[i];
+        if (instruction->type == CommandLabel && instruction->index >= 0 && instruction->index < subroutine->number_of_labels) {
+            isRemoved[i] = !isLabelUsed[instruction->index];
+        }
+    }
+    removeInstructions(subroutine, isRemoved);
+    
+    free(isRemoved);
+    free(isLabelUsed);
+}
+
+void writeInstruction(FILE *outputFile, Instruction *instruction, char *subroutineName) {
+    switch (instruction->type) {
+        case CommandPush:
+        case CommandPop:
+            fputs(instruction->type == CommandPush ? "push " : "pop ", outputFile);
+            fputs(segmentNames[instruction->segment], outputFile);
+            fputc(' ', outputFile);
+            writeNumber(outputFile, instruction->index);
+            fputc('\n', outputFile);
             break;
-        case TokenTypeInteger:
-            fprintf(outputFile, "push constant %s\n", line);
-            break;
-        case TokenTypeKeyword:
-            if (!strcmp("true", line)) {
-                fputs("push constant 1\nneg\n", outputFile);
-            } else if (!strcmp("false", line) || !strcmp("null", line)) {
-                fputs("push constant 0\n", outputFile);
-            } else if (!strcmp("this", line)) {
-                fputs("push pointer 0\n", outputFile);
+        case CommandLabel:
+        case CommandGoto:
+        case CommandIfGoto:
+            if (instruction->index < 0) {
+                fputs(instruction->text, outputFile);
+                fputc('\n', outputFile);
             } else {
-                printf("Unrecognized keyword used as term: %s!\n", line);
-                exit(1);
+                writeSubroutineLabel(outputFile, instruction->type == CommandLabel ? "label" : instruction->type == CommandGoto ? "goto" : "if-goto",
+                                     subroutineName, instruction->index);
             }
             break;
-        case TokenTypeIdentifier:
-        {
-            fgets_nl(line, sizeof(line), inputFile);
-            fsetpos(inputFile, &initialTermPos); //TODO: this is weird and hacky
-            if (!strcmp(line, "[")) {
-                fgets_nl(line, sizeof(line), inputFile);
-                Symbol *symbol = symbolWithName(line);
-                if (!symbol) {
-                    printf("Variable '%s' could not be found in the symbol table!\n", line);
-                    exit(1);
+        case CommandFunction:
+            fputs(instruction->text, outputFile);
+            fputc(' ', outputFile);
+            writeNumber(outputFile, instruction->index);
+            fputc('\n', outputFile);
+            break;
+        default:
+            fputs(instruction->text, outputFile);
+            fputc('\n', outputFile);
+            break;
+    }
+}
+
+void setBit(uint64_t *bits, int bit) {
+    bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+void clearBit(uint64_t *bits, int bit) {
+    bits[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+}
+
+int isBitSet(uint64_t *bits, int bit) {
+    return (bits[bit / 64] >> (bit % 64)) & 1;
+}
+
+//computes which locals are live on entry to and exit from every block, as bitsets of wordCount words each
+void computeLiveLocals(Subroutine *subroutine, size_t wordCount, uint64_t *liveIn, uint64_t *liveOut) {
+    int number_of_blocks = subroutine->number_of_blocks;
+    uint64_t *used = calloc(number_of_blocks * wordCount, sizeof(uint64_t));
+    uint64_t *defined = calloc(number_of_blocks * wordCount, sizeof(uint64_t));
+    
+    for (int i = 0; i < number_of_blocks; i++) {
+        Block *block = &subroutine->blocks[i];
+        for (size_t j = block->first; j < block->end; j++) {
+            Instruction *instruction = &subroutine->instructions[j];
+            if (instruction->segment != SegmentLocal) { continue; }
+            
+            if (instruction->type == CommandPush && !isBitSet(defined + i * wordCount, instruction->index)) {
+                setBit(used + i * wordCount, instruction->index);
+            } else if (instruction->type == CommandPop) {
+                setBit(defined + i * wordCount, instruction->index);
+            }
+        }
+    }
+    
+    int isChanged = 1;
+    while (isChanged) {
+        isChanged = 0;
+        for (int i = number_of_blocks - 1; i >= 0; i--) {
+            Block *block = &subroutine->blocks[i];
+            uint64_t *out = liveOut + i * wordCount;
+            uint64_t *in = liveIn + i * wordCount;
+            
+            for (size_t word = 0; word < wordCount; word++) {
+                uint64_t live = 0;
+                for (int j = 0; j < block->number_of_successors; j++) {
+                    live |= liveIn[block->successors[j] * wordCount + word];
                 }
+                out[word] = live;
                 
-                writeSymbol(outputFile, "push", symbol);
-                
-                fgets_nl(line, sizeof(line), inputFile);
-                compileExpression(inputFile, outputFile);
-                
-                fgets_nl(line, sizeof(line), inputFile);
-                if (strcmp(line, "]")) {
-                    printf("Expected ']' to end expression, not '%s'!\n", line);
-                    exit(1);
+                live = used[i * wordCount + word] | (live & ~defined[i * wordCount + word]);
+                if (live != in[word]) {
+                    in[word] = live;
+                    isChanged = 1;
                 }
-                
-                fputs("add\n", outputFile);
-                fputs("pop pointer 1\npush that 0\n", outputFile);
-            } else if (!strcmp(line, "(") || !strcmp(line, ".")) {
-                compileSubroutineCall(inputFile, outputFile, 1);
+            }
+        }
+    }
+    
+    free(defined);
+    free(used);
+}
+
+//gives locals whose live ranges never overlap the same slot and shrinks the function's local count to match,
+//stores to locals that are never read again become pops to temp 0
+void compactLocals(Subroutine *subroutine) {
+    Instruction *header = &subroutine->instructions[0];
+    int number_of_locals = header->index;
+    if (header->type != CommandFunction || number_of_locals == 0) { return; }
+    
+    buildBlocks(subroutine);
+    
+    size_t wordCount = (number_of_locals + 63) / 64;
+    uint64_t *liveIn = calloc((subroutine->number_of_blocks + 1) * wordCount, sizeof(uint64_t));
+    uint64_t *liveOut = calloc((subroutine->number_of_blocks + 1) * wordCount, sizeof(uint64_t));
+    computeLiveLocals(subroutine, wordCount, liveIn, liveOut);
+    
+    uint64_t *interferences = calloc(number_of_locals * wordCount, sizeof(uint64_t));
+    uint64_t *live = malloc(wordCount * sizeof(uint64_t));
+    char *isReferenced = calloc(number_of_locals, 1);
+    for (int i = 0; i < subroutine->number_of_blocks; i++) {
+        Block *block = &subroutine->blocks[i];
+        memcpy(live, liveOut + i * wordCount, wordCount * sizeof(uint64_t));
+        
+        for (size_t j = block->end; j-- > block->first; ) {
+            Instruction *instruction = &subroutine->instructions[j];
+            if (instruction->segment != SegmentLocal || (instruction->type != CommandPush && instruction->type != CommandPop)) { continue; }
+            
+            int local = instruction->index;
+            if (instruction->type == CommandPush) {
+                setBit(live, local);
+                isReferenced[local] = 1;
+            } else if (!isBitSet(live, local)) {
+                instruction->segment = SegmentTemp;
+                instruction->index = 0;
             } else {
-                fgets_nl(line, sizeof(line), inputFile);
-                
-                Symbol *symbol = symbolWithName(line);
-                if (!symbol) {
-                    printf("Variable '%s' could not be found in the symbol table!\n", line);
-                    exit(1);
+                clearBit(live, local);
+                for (size_t word = 0; word < wordCount; word++) {
+                    interferences[local * wordCount + word] |= live[word];
+                }
+                for (int other = 0; other < number_of_locals; other++) {
+                    if (isBitSet(live, other)) {
+                        setBit(interferences + other * wordCount, local);
+                    }
                 }
-                
-                writeSymbol(outputFile, "push", symbol);
             }
-            break;
         }
-        case TokenTypeSymbol:
-            if (!strcmp(line, "(")) {
-                compileExpression(inputFile, outputFile);
-                
-                fgets_nl(line, sizeof(line), inputFile);
-                if (strcmp(line, ")")) {
-                    printf("Expected ')' to end expression!\n");
-                    exit(1);
-                }
-            } else if (!strcmp(line, "-") || !strcmp(line, "~")) {
-                compileTerm(inputFile, outputFile);
-                
-                char *action = !strcmp(line, "-") ? "neg" : "not";
-                fprintf(outputFile, "%s\n", action);
+    }
+    
+    //greedy coloring in declaration order
+    int *slots = malloc(number_of_locals * sizeof(int));
+    char *isSlotTaken = malloc(number_of_locals + 1);
+    int number_of_slots = 0;
+    for (int local = 0; local < number_of_locals; local++) {
+        slots[local] = -1;
+        if (!isReferenced[local]) { continue; }
+        
+        memset(isSlotTaken, 0, number_of_locals + 1);
+        for (int other = 0; other < local; other++) {
+            if (slots[other] >= 0 && isBitSet(interferences + local * wordCount, other)) {
+                isSlotTaken[slots[other]] = 1;
             }
-            break;
-        default:
-            printf("Invalid token type!\n");
-            exit(1);
-            break;
+        }
+        
+        int slot = 0;
+        while (isSlotTaken[slot]) {
+            slot++;
+        }
+        slots[local] = slot;
+        if (slot + 1 > number_of_slots) {
+            number_of_slots = slot + 1;
+        }
+    }
+    
+    for (size_t i = 0; i < subroutine->number_of_instructions; i++) {
+        Instruction *instruction = &subroutine->instructions[i];
+        if ((instruction->type == CommandPush || instruction->type == CommandPop) && instruction->segment == SegmentLocal) {
+            instruction->index = slots[instruction->index];
+        }
     }
+    header->index = number_of_slots;
+    
+    free(isSlotTaken);
+    free(slots);
+    free(isReferenced);
+    free(live);
+    free(interferences);
+    free(liveOut);
+    free(liveIn);
+    freeBlocks(subroutine);
 }
 
-void compileExpression(FILE *inputFile, FILE *outputFile) {
-    char line[256];
+size_t nextInstruction(Subroutine *subroutine, size_t position) {
+    position++;
+    while (position < subroutine->number_of_instructions && subroutine->instructions[position].type == CommandLabel) {
+        position++;
+    }
+    return position;
+}
+
+int isSelfTailCall(Subroutine *subroutine, size_t position, char *name, int number_of_arguments, int isReturningZero) {
+    Instruction *instructions = subroutine->instructions;
+    Instruction *call = &instructions[position];
+    size_t length = strlen(name);
+    if (call->type != CommandCall || strncmp(call->text + 5, name, length) || call->text[5 + length] != ' ' ||
+        atoi(call->text + 5 + length + 1) != number_of_arguments) { return 0; }
     
-    char *operation = NULL;
-    while (1) {
-        compileTerm(inputFile, outputFile);
+    size_t next = nextInstruction(subroutine, position);
+    if (next < subroutine->number_of_instructions && instructions[next].type == CommandReturn) {
+        return 1;
+    }
+    
+    //'do f(); return;' in a function whose every return gives 0 discards a result that can only be 0 anyway
+    if (!isReturningZero || next >= subroutine->number_of_instructions || instructions[next].type != CommandPop ||
+        instructions[next].segment != SegmentTemp) { return 0; }
+    
+    next = nextInstruction(subroutine, next);
+    if (next >= subroutine->number_of_instructions || instructions[next].type != CommandPush ||
+        instructions[next].segment != SegmentConstant || instructions[next].index != 0) { return 0; }
+    
+    next = nextInstruction(subroutine, next);
+    return next < subroutine->number_of_instructions && instructions[next].type == CommandReturn;
+}
+
+//the locals that may be read before they are written, which a call leaves 0 and so a jump back to the entry must zero
+uint64_t *localsLiveAtEntry(Subroutine *subroutine) {
+    int number_of_locals = subroutine->instructions[0].index;
+    size_t wordCount = (number_of_locals + 63) / 64;
+    uint64_t *entryLocals = calloc(wordCount + 1, sizeof(uint64_t));
+    if (number_of_locals) {
+        buildBlocks(subroutine);
+        uint64_t *liveIn = calloc((subroutine->number_of_blocks + 1) * wordCount, sizeof(uint64_t));
+        uint64_t *liveOut = calloc((subroutine->number_of_blocks + 1) * wordCount, sizeof(uint64_t));
+        computeLiveLocals(subroutine, wordCount, liveIn, liveOut);
+        if (subroutine->number_of_blocks) {
+            memcpy(entryLocals, liveIn, wordCount * sizeof(uint64_t));
+        }
         
-        if (operation) {
-            fprintf(outputFile, "%s\n", operation);
+        free(liveOut);
+        free(liveIn);
+        freeBlocks(subroutine);
+    }
+    
+    return entryLocals;
+}
+
+//turns 'call <this subroutine>' followed by a return into storing the new arguments and jumping back to the entry,
+//clearing the locals that are read before they are written. Calls to other subroutines are left alone, as the VM
+//cannot jump between functions. Returns the number of calls converted.
+int convertSelfTailCalls(Subroutine *subroutine) {
+    Instruction *header = &subroutine->instructions[0];
+    if (header->type != CommandFunction || subroutine->declaration < 0) { return 0; }
+    
+    SubroutineDeclaration *declaration = &class_subroutines[subroutine->declaration];
+    if (!strcmp(declaration->kind, "constructor")) { return 0; }
+    
+    char *name = header->text + strlen("function ");
+    int number_of_arguments = declaration->number_of_parameters + !strcmp(declaration->kind, "method");
+    
+    int isReturningZero = 1;
+    for (size_t i = 1; i < subroutine->number_of_instructions; i++) {
+        Instruction *previous = &subroutine->instructions[i - 1];
+        if (subroutine->instructions[i].type == CommandReturn &&
+            (previous->type != CommandPush || previous->segment != SegmentConstant || previous->index != 0)) {
+            isReturningZero = 0;
+        }
+    }
+    
+    int number_of_calls = 0;
+    for (size_t i = 1; i < subroutine->number_of_instructions; i++) {
+        number_of_calls += isSelfTailCall(subroutine, i, name, number_of_arguments, isReturningZero);
+    }
+    if (!number_of_calls) { return 0; }
+    
+    int number_of_locals = header->index;
+    uint64_t *entryLocals = localsLiveAtEntry(subroutine);
+    
+    Subroutine converted = *subroutine;
+    converted.length_of_instructions = subroutine->number_of_instructions + 2;
+    converted.number_of_instructions = 0;
+    converted.instructions = malloc(converted.length_of_instructions * sizeof(Instruction));
+    int entryLabel = converted.number_of_labels++;
+    
+    Instruction instruction;
+    memset(&instruction, 0, sizeof(instruction));
+    addInstruction(&converted, *header);
+    instruction.type = CommandLabel;
+    instruction.index = entryLabel;
+    addInstruction(&converted, instruction);
+    
+    for (size_t i = 1; i < subroutine->number_of_instructions; i++) {
+        if (!isSelfTailCall(subroutine, i, name, number_of_arguments, isReturningZero)) {
+            addInstruction(&converted, subroutine->instructions[i]);
+            continue;
         }
         
-        fpos_t pos;
-        fgetpos(inputFile, &pos);
+        instruction.line = subroutine->instructions[i].line;
+        instruction.column = subroutine->instructions[i].column;
+        instruction.type = CommandPop;
+        instruction.segment = SegmentArgument;
+        for (int argument = number_of_arguments - 1; argument >= 0; argument--) {
+            instruction.index = argument;
+            addInstruction(&converted, instruction);
+        }
         
-        fgets_nl(line, sizeof(line), inputFile);
-        if (!strcmp(line, "+")) {
-            operation = "add";
-        } else if (!strcmp(line, "-")) {
-            operation = "sub";
-        } else if (!strcmp(line, "*")) {
-            operation = "call Math.multiply 2";
-        } else if (!strcmp(line, "/")) {
-            operation = "call Math.divide 2";
-        } else if (!strcmp(line, "&amp;")) {
-            operation = "and";
-        } else if (!strcmp(line, "|")) {
-            operation = "or";
-        } else if (!strcmp(line, "&lt;")) {
-            operation = "lt";
-        } else if (!strcmp(line, "&gt;")) {
-            operation = "gt";
-        } else if (!strcmp(line, "=")) {
-            operation = "eq";
-        } else {
-            fsetpos(inputFile, &pos);
-            break;
+        for (int local = 0; local < number_of_locals; local++) {
+            if (!isBitSet(entryLocals, local)) { continue; }
+            
+            instruction.type = CommandPush;
+            instruction.segment = SegmentConstant;
+            instruction.index = 0;
+            addInstruction(&converted, instruction);
+            instruction.type = CommandPop;
+            instruction.segment = SegmentLocal;
+            instruction.index = local;
+            addInstruction(&converted, instruction);
         }
+        
+        instruction.type = CommandGoto;
+        instruction.index = entryLabel;
+        addInstruction(&converted, instruction);
     }
+    
+    free(entryLocals);
+    free(subroutine->instructions);
+    *subroutine = converted;
+    
+    return number_of_calls;
 }
 
-void compileStatements(FILE *inputFile, FILE *outputFile) {
-    char line[256];
-
-    while (1) {
-        fpos_t pos;
-        fgetpos(inputFile, &pos);
+//runs the passes the options ask for, counting the locals before and after in the statistics
+void optimizeSubroutine(Subroutine *subroutine) {
+    if (options.optimize) {
+        removeUnreachableBlocks(subroutine);
+        simplifyJumps(subroutine);
+        removeUnreachableBlocks(subroutine);
         
-        fgets_nl(line, sizeof(line), inputFile);
-        if (!strcmp(line, "let") || !strcmp(line, "if") || !strcmp(line, "while") || !strcmp(line, "do") || !strcmp(line, "return")) {
-            char *statementType = malloc(strlen(line));
-            strcpy(statementType, line);
+        if (options.convertTailCalls && convertSelfTailCalls(subroutine)) {
+            removeUnreachableBlocks(subroutine);
+        }
+    }
+    if (options.optimize || options.stripUnusedLabels) {
+        removeUnusedLabels(subroutine);
+    }
+    
+    Instruction *header = &subroutine->instructions[0];
+    if (header->type == CommandFunction) {
+        statistics.declaredLocals += header->index;
+        if (options.optimize) {
+            compactLocals(subroutine);
+        }
+        statistics.allocatedLocals += header->index;
+    }
+}
 
-            if (!strcmp(line, "let")) {
-                fgets_nl(line, sizeof(line), inputFile);
-                Symbol *symbol = NULL;
-                if (tokenType(line) == TokenTypeIdentifier) {
+void writeInstructions(FILE *outputFile, Subroutine *subroutine) {
+    char *name = subroutine->declaration >= 0 ? class_subroutines[subroutine->declaration].name : currentSubroutine;
+    size_t firstInstruction = statistics.instructions;
+    statistics.instructions += subroutine->number_of_instructions;
+    
+    for (size_t i = 0; i < subroutine->number_of_instructions; i++) {
+        Instruction *instruction = &subroutine->instructions[i];
+        if (sourceMapFile && instruction->line && (instruction->line != sourceMapLine || instruction->column != sourceMapColumn)) {
+            fprintf(sourceMapFile, "%zu %d %d\n", firstInstruction + i, instruction->line, instruction->column);
+            sourceMapLine = instruction->line;
+            sourceMapColumn = instruction->column;
+        }
+        writeInstruction(outputFile, instruction, name);
+    }
+}
+
+void writeSubroutine(FILE *outputFile, char *buffer) {
+    Subroutine subroutine;
+    memset(&subroutine, 0, sizeof(subroutine));
+    readSubroutine(&subroutine, buffer);
+    
+    optimizeSubroutine(&subroutine);
+    writeInstructions(outputFile, &subroutine);
+    
+    free(subroutine.labelBlocks);
+    free(subroutine.instructions);
+}
+
+#pragma mark Profile-Guided Passes
+
+//keeps a compiled subroutine until writeProfiledClass, taking over its buffer
+void keepSubroutine(char *buffer) {
+    class_bodies = realloc(class_bodies, (number_of_class_bodies + 1) * sizeof(Subroutine));
+    Subroutine *subroutine = &class_bodies[number_of_class_bodies++];
+    memset(subroutine, 0, sizeof(Subroutine));
+    readSubroutine(subroutine, buffer);
+    subroutine->buffer = buffer;
+}
+
+void freeClassBodies() {
+    for (size_t i = 0; i < number_of_class_bodies; i++) {
+        free(class_bodies[i].labelBlocks);
+        free(class_bodies[i].instructions);
+        free(class_bodies[i].buffer);
+    }
+    free(class_bodies);
+    class_bodies = NULL;
+    number_of_class_bodies = 0;
+}
+
+const size_t maximumInlineSize = 24; //instructions in the body of an inlined function, besides its header
+
+//a function can be inlined when it is small, does not call itself and leaves pointer, this and that alone,
+//so the caller's that pointer stays as valid as it would across the call
+int isInlinable(Subroutine *subroutine) {
+    Instruction *header = &subroutine->instructions[0];
+    if (header->type != CommandFunction || strcmp(class_subroutines[subroutine->declaration].kind, "function") ||
+        subroutine->number_of_instructions - 1 > maximumInlineSize) { return 0; }
+    
+    char *name = header->text + strlen("function ");
+    size_t length = strlen(name);
+    for (size_t i = 1; i < subroutine->number_of_instructions; i++) {
+        Instruction *instruction = &subroutine->instructions[i];
+        if ((instruction->type == CommandPush || instruction->type == CommandPop) &&
+            (instruction->segment == SegmentPointer || instruction->segment == SegmentThis || instruction->segment == SegmentThat)) { return 0; }
+        if (instruction->type == CommandCall && !strncmp(instruction->text + 5, name, length) && instruction->text[5 + length] == ' ') { return 0; }
+    }
+    return 1;
+}
+
+//the kept subroutine of the current class that a call calls, or -1
+int calledClassBody(Instruction *call) {
+    size_t classLength = strlen(currentClass);
+    if (strncmp(call->text + 5, currentClass, classLength) || call->text[5 + classLength] != '.') { return -1; }
+    
+    char *name = call->text + 5 + classLength + 1;
+    for (size_t i = 0; i < number_of_class_bodies; i++) {
+        char *bodyName = class_subroutines[class_bodies[i].declaration].name;
+        size_t length = strlen(bodyName);
+        if (!strncmp(name, bodyName, length) && name[length] == ' ') {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+//replaces calls to hot inlinable functions with their bodies. The arguments and locals of each inlined body become new locals
+//of the caller, which compactLocals later packs with the caller's own. Locals that are read before being written are zeroed as a call would.
+void inlineHotCalls(Subroutine *caller, char *isInlinableBody) {
+    if (caller->instructions[0].type != CommandFunction || !functionCount(class_subroutines[caller->declaration].name)) { return; }
+    
+    Subroutine inlined = *caller;
+    inlined.length_of_instructions = caller->number_of_instructions * 2;
+    inlined.number_of_instructions = 0;
+    inlined.instructions = malloc(inlined.length_of_instructions * sizeof(Instruction));
+    
+    int number_of_calls = 0;
+    for (size_t i = 0; i < caller->number_of_instructions; i++) {
+        Instruction *call = &caller->instructions[i];
+        int body = call->type == CommandCall ? calledClassBody(call) : -1;
+        if (body < 0 || &class_bodies[body] == caller || !isInlinableBody[body] ||
+            !isHot(functionCount(class_subroutines[class_bodies[body].declaration].name))) {
+            addInstruction(&inlined, *call);
+            continue;
+        }
+        number_of_calls++;
+        
+        Subroutine *callee = &class_bodies[body];
+        int number_of_arguments = class_subroutines[callee->declaration].number_of_parameters;
+        int number_of_locals = callee->instructions[0].index;
+        int firstLocal = inlined.instructions[0].index;
+        inlined.instructions[0].index += number_of_arguments + number_of_locals;
+        int firstLabel = inlined.number_of_labels;
+        int returnLabel = firstLabel + callee->number_of_labels;
+        inlined.number_of_labels = returnLabel + 1;
+        
+        Instruction instruction = *call;
+        instruction.type = CommandPop;
+        instruction.segment = SegmentLocal;
+        for (int argument = number_of_arguments - 1; argument >= 0; argument--) {
+            instruction.index = firstLocal + argument;
+            addInstruction(&inlined, instruction);
+        }
+        uint64_t *entryLocals = localsLiveAtEntry(callee);
+        for (int local = 0; local < number_of_locals; local++) {
+            if (!isBitSet(entryLocals, local)) { continue; }
+            
+            instruction.type = CommandPush;
+            instruction.segment = SegmentConstant;
+            instruction.index = 0;
+            addInstruction(&inlined, instruction);
+            instruction.type = CommandPop;
+            instruction.segment = SegmentLocal;
+            instruction.index = firstLocal + number_of_arguments + local;
+            addInstruction(&inlined, instruction);
+        }
+        free(entryLocals);
+        
+        for (size_t j = 1; j < callee->number_of_instructions; j++) {
+            instruction = callee->instructions[j];
+            if ((instruction.type == CommandPush || instruction.type == CommandPop) && instruction.segment == SegmentArgument) {
+                instruction.segment = SegmentLocal;
+                instruction.index += firstLocal;
+            } else if ((instruction.type == CommandPush || instruction.type == CommandPop) && instruction.segment == SegmentLocal) {
+                instruction.index += firstLocal + number_of_arguments;
+            } else if ((instruction.type == CommandLabel || isJump(&instruction)) && instruction.index >= 0) {
+                instruction.index += firstLabel;
+            } else if (instruction.type == CommandReturn) {
+                instruction.type = CommandGoto;
+                instruction.index = returnLabel;
+            }
+            addInstruction(&inlined, instruction);
+        }
+        
+        instruction = *call;
+        instruction.type = CommandLabel;
+        instruction.index = returnLabel;
+        addInstruction(&inlined, instruction);
+    }
+    
+    if (number_of_calls) {
+        free(caller->instructions);
+        *caller = inlined;
+    } else {
+        free(inlined.instructions);
+    }
+}
+
+//inlines, optimizes and writes the kept subroutines, the ones called most often first
+void writeProfiledClass(FILE *outputFile) {
+    char *isInlinableBody = malloc(number_of_class_bodies + 1);
+    for (size_t i = 0; i < number_of_class_bodies; i++) {
+        isInlinableBody[i] = (char)isInlinable(&class_bodies[i]);
+    }
+    for (size_t i = 0; i < number_of_class_bodies; i++) {
+        inlineHotCalls(&class_bodies[i], isInlinableBody);
+    }
+    
+    //a stable insertion sort, so subroutines with equal counts stay in source order
+    size_t *order = malloc((number_of_class_bodies + 1) * sizeof(size_t));
+    unsigned long *counts = malloc((number_of_class_bodies + 1) * sizeof(unsigned long));
+    for (size_t i = 0; i < number_of_class_bodies; i++) {
+        unsigned long count = functionCount(class_subroutines[class_bodies[i].declaration].name);
+        size_t j = i;
+        while (j > 0 && counts[j - 1] < count) {
+            order[j] = order[j - 1];
+            counts[j] = counts[j - 1];
+            j--;
+        }
+        order[j] = i;
+        counts[j] = count;
+    }
+    
+    for (size_t i = 0; i < number_of_class_bodies; i++) {
+        optimizeSubroutine(&class_bodies[order[i]]);
+        writeInstructions(outputFile, &class_bodies[order[i]]);
+        fputc('\n', outputFile);
+    }
+    
+    free(counts);
+    free(order);
+    free(isInlinableBody);
+    freeClassBodies();
+}
+
+#pragma mark Class Interfaces
+
+//an interface file is a header followed by the variable, subroutine, parameter and dependency records and then a table of
+//nul terminated strings, every string being referred to by its offset into that table
+typedef struct InterfaceHeader {
+    char magic[4];
+    uint32_t name;
+    uint32_t number_of_variables;
+    uint32_t number_of_subroutines;
+    uint32_t number_of_parameters;
+    uint32_t number_of_dependencies;
+    uint32_t length_of_strings;
+} InterfaceHeader;
+
+typedef struct InterfaceVariable {
+    uint32_t name;
+    uint32_t type;
+    uint32_t kind;
+    uint32_t index;
+} InterfaceVariable;
+
+typedef struct InterfaceSubroutine {
+    uint32_t name;
+    uint32_t kind;
+    uint32_t returnType;
+    uint32_t number_of_parameters;
+    uint32_t first_parameter;
+    uint32_t isPure;
+} InterfaceSubroutine;
+
+//a subroutine of another class that was taken to be pure while compiling this one, the purity recorded here only holds
+//as long as that subroutine still is
+typedef struct InterfaceDependency {
+    uint32_t className;
+    uint32_t subroutineName;
+} InterfaceDependency;
+
+typedef struct ClassInterface {
+    char *path;
+    unsigned char *bytes; //NULL when there is no usable interface file
+    size_t size;
+    int isMapped; //the bytes are a mapping of the file rather than an interface the server kept
+    int isChecked; //the subroutines its purity depends on have been looked up
+    int isCurrent; //written after the class source last changed and its dependencies still hold, so what it says about subroutine bodies holds
+} ClassInterface;
+
+ClassInterface *class_interfaces;
+size_t number_of_class_interfaces;
+
+//the subroutines of other classes the class being compiled took to be pure
+typedef struct PureDependency {
+    char *className;
+    char *subroutineName;
+} PureDependency;
+
+PureDependency *pure_dependencies;
+size_t number_of_pure_dependencies;
+
+const char interfaceMagic[4] = {'J', 'K', 'I', 3};
+
+void freeClassSubroutines() {
+    for (size_t i = 0; i < number_of_class_subroutines; i++) {
+        SubroutineDeclaration *declaration = &class_subroutines[i];
+        free(declaration->name);
+        free(declaration->kind);
+        free(declaration->returnType);
+        for (int j = 0; j < declaration->number_of_parameters; j++) {
+            free(declaration->parameterTypes[j]);
+        }
+        free(declaration->parameterTypes);
+    }
+    
+    free(class_subroutines);
+    class_subroutines = NULL;
+    number_of_class_subroutines = 0;
+    
+    for (size_t i = 0; i < number_of_pure_dependencies; i++) {
+        free(pure_dependencies[i].className);
+        free(pure_dependencies[i].subroutineName);
+    }
+    free(pure_dependencies);
+    pure_dependencies = NULL;
+    number_of_pure_dependencies = 0;
+}
+
+char *copyString(const char *string) {
+    char *copy = malloc(strlen(string) + 1);
+    strcpy(copy, string);
+    return copy;
+}
+
+void addSubroutineDeclaration(char *name, char *kind, char *returnType) {
+    number_of_class_subroutines++;
+    class_subroutines = realloc(class_subroutines, number_of_class_subroutines * sizeof(SubroutineDeclaration));
+    
+    SubroutineDeclaration *declaration = &class_subroutines[number_of_class_subroutines - 1];
+    declaration->name = copyString(name);
+    declaration->kind = copyString(kind);
+    declaration->returnType = copyString(returnType);
+    declaration->number_of_parameters = 0;
+    declaration->parameterTypes = NULL;
+    declaration->isPure = 0;
+    
+    for (int i = 0; i < *number_of_sub_symbols; i++) {
+        Symbol *symbol = sub_symbols[i];
+        if (strcmp(symbol->kind, "argument") || (!strcmp(kind, "method") && symbol->scope == 0)) { continue; }
+        
+        declaration->number_of_parameters++;
+        declaration->parameterTypes = realloc(declaration->parameterTypes, declaration->number_of_parameters * sizeof(char *));
+        declaration->parameterTypes[declaration->number_of_parameters - 1] = copyString(symbol->type);
+    }
+}
+
+uint32_t addInterfaceString(char **strings, uint32_t *length_of_strings, const char *string) {
+    uint32_t offset = *length_of_strings;
+    size_t length = strlen(string) + 1;
+    
+    *strings = realloc(*strings, offset + length);
+    memcpy(*strings + offset, string, length);
+    *length_of_strings += length;
+    
+    return offset;
+}
+
+uint32_t interfaceKind(char *kind) {
+    if (!strcmp(kind, "field") || !strcmp(kind, "method")) { return 2; }
+    if (!strcmp(kind, "function")) { return 1; }
+    return 0; //static or constructor
+}
+
+//writes the interface file of the class just compiled and returns its bytes, which the caller frees
+char *writeClassInterface(char *inputPath, size_t *length) {
+    char *strings = NULL;
+    uint32_t length_of_strings = 0;
+    
+    InterfaceHeader header;
+    memcpy(header.magic, interfaceMagic, sizeof(header.magic));
+    header.name = addInterfaceString(&strings, &length_of_strings, currentClass);
+    header.number_of_variables = (uint32_t)*number_of_class_symbols;
+    header.number_of_subroutines = (uint32_t)number_of_class_subroutines;
+    header.number_of_parameters = 0;
+    header.number_of_dependencies = (uint32_t)number_of_pure_dependencies;
+    
+    InterfaceVariable *variables = malloc((*number_of_class_symbols + 1) * sizeof(InterfaceVariable));
+    for (int i = 0; i < *number_of_class_symbols; i++) {
+        Symbol *symbol = class_symbols[i];
+        variables[i].name = addInterfaceString(&strings, &length_of_strings, symbol->name);
+        variables[i].type = addInterfaceString(&strings, &length_of_strings, symbol->type);
+        variables[i].kind = interfaceKind(symbol->kind);
+        variables[i].index = symbol->scope;
+    }
+    
+    InterfaceSubroutine *subroutines = malloc((number_of_class_subroutines + 1) * sizeof(InterfaceSubroutine));
+    uint32_t *parameters = NULL;
+    for (size_t i = 0; i < number_of_class_subroutines; i++) {
+        SubroutineDeclaration *declaration = &class_subroutines[i];
+        subroutines[i].name = addInterfaceString(&strings, &length_of_strings, declaration->name);
+        subroutines[i].kind = interfaceKind(declaration->kind);
+        subroutines[i].returnType = addInterfaceString(&strings, &length_of_strings, declaration->returnType);
+        subroutines[i].number_of_parameters = declaration->number_of_parameters;
+        subroutines[i].first_parameter = header.number_of_parameters;
+        subroutines[i].isPure = declaration->isPure;
+        
+        header.number_of_parameters += declaration->number_of_parameters;
+        parameters = realloc(parameters, header.number_of_parameters * sizeof(uint32_t));
+        for (int j = 0; j < declaration->number_of_parameters; j++) {
+            parameters[subroutines[i].first_parameter + j] = addInterfaceString(&strings, &length_of_strings, declaration->parameterTypes[j]);
+        }
+    }
+    
+    InterfaceDependency *dependencies = malloc((number_of_pure_dependencies + 1) * sizeof(InterfaceDependency));
+    for (size_t i = 0; i < number_of_pure_dependencies; i++) {
+        dependencies[i].className = addInterfaceString(&strings, &length_of_strings, pure_dependencies[i].className);
+        dependencies[i].subroutineName = addInterfaceString(&strings, &length_of_strings, pure_dependencies[i].subroutineName);
+    }
+    header.length_of_strings = length_of_strings;
+    
+    char *interface = NULL;
+    FILE *interfaceStream = open_memstream(&interface, length);
+    fwrite(&header, sizeof(header), 1, interfaceStream);
+    fwrite(variables, sizeof(InterfaceVariable), header.number_of_variables, interfaceStream);
+    fwrite(subroutines, sizeof(InterfaceSubroutine), header.number_of_subroutines, interfaceStream);
+    fwrite(parameters, sizeof(uint32_t), header.number_of_parameters, interfaceStream);
+    fwrite(dependencies, sizeof(InterfaceDependency), header.number_of_dependencies, interfaceStream);
+    fwrite(strings, 1, length_of_strings, interfaceStream);
+    fclose(interfaceStream);
+    
+    //written next to the old file and renamed over it, as another compile may still have the old one mapped.
+    //unlike other outputs it is replaced right away, the classes compiled after it read it and its mtime marks it current
+    char *interfacePath = pathWithInputPath(inputPath, ".jacki");
+    char *temporaryPath = NULL;
+    FILE *interfaceFile = createTemporaryFile(interfacePath, &temporaryPath);
+    if (interfaceFile) {
+        fwrite(interface, 1, *length, interfaceFile);
+        if (fclose(interfaceFile) || rename(temporaryPath, interfacePath)) {
+            remove(temporaryPath);
+        }
+    }
+    
+    free(temporaryPath);
+    free(interfacePath);
+    free(dependencies);
+    free(parameters);
+    free(subroutines);
+    free(variables);
+    free(strings);
+    
+    return interface;
+}
+
+//checks that every count and string offset stays inside the mapping, so later lookups can trust the file
+int isValidInterface(unsigned char *bytes, size_t size) {
+    if (size < sizeof(InterfaceHeader) || memcmp(bytes, interfaceMagic, sizeof(interfaceMagic))) { return 0; }
+    
+    InterfaceHeader *header = (InterfaceHeader *)bytes;
+    uint64_t length = sizeof(InterfaceHeader) + (uint64_t)header->number_of_variables * sizeof(InterfaceVariable) +
+                      (uint64_t)header->number_of_subroutines * sizeof(InterfaceSubroutine) +
+                      (uint64_t)header->number_of_parameters * sizeof(uint32_t) +
+                      (uint64_t)header->number_of_dependencies * sizeof(InterfaceDependency) + header->length_of_strings;
+    if (length != size || header->length_of_strings == 0 || bytes[size - 1] != 0 || header->name >= header->length_of_strings) { return 0; }
+    
+    InterfaceSubroutine *subroutines = (InterfaceSubroutine *)(bytes + sizeof(InterfaceHeader) + header->number_of_variables * sizeof(InterfaceVariable));
+    uint32_t *parameters = (uint32_t *)(subroutines + header->number_of_subroutines);
+    for (uint32_t i = 0; i < header->number_of_subroutines; i++) {
+        InterfaceSubroutine *subroutine = &subroutines[i];
+        if (subroutine->name >= header->length_of_strings || subroutine->returnType >= header->length_of_strings ||
+            (uint64_t)subroutine->first_parameter + subroutine->number_of_parameters > header->number_of_parameters) { return 0; }
+    }
+    for (uint32_t i = 0; i < header->number_of_parameters; i++) {
+        if (parameters[i] >= header->length_of_strings) { return 0; }
+    }
+    InterfaceDependency *dependencies = (InterfaceDependency *)(parameters + header->number_of_parameters);
+    for (uint32_t i = 0; i < header->number_of_dependencies; i++) {
+        if (dependencies[i].className >= header->length_of_strings || dependencies[i].subroutineName >= header->length_of_strings) { return 0; }
+    }
+    
+    return 1;
+}
+
+int findSubroutine(char *className, char *subName, uint32_t *kind, uint32_t *number_of_parameters, uint32_t *isPure, int *isKnownClass);
+
+//a class the server compiled before is known from the interface that compile sent back, which the server only
+//passes on while the source of the class is unchanged. The bytes stay the server's
+void addClassInterface(char *path, unsigned char *bytes, size_t size) {
+    number_of_class_interfaces++;
+    class_interfaces = realloc(class_interfaces, number_of_class_interfaces * sizeof(ClassInterface));
+    class_interfaces[number_of_class_interfaces - 1] = (ClassInterface){path, bytes, size, 0, 0, 1};
+}
+
+//maps and validates the interface file at path and decides from its mtime whether it is current
+ClassInterface *mapClassInterface(char *path) {
+    number_of_class_interfaces++;
+    class_interfaces = realloc(class_interfaces, number_of_class_interfaces * sizeof(ClassInterface));
+    ClassInterface *interface = &class_interfaces[number_of_class_interfaces - 1];
+    *interface = (ClassInterface){path, NULL, 0, 0, 0, 0};
+    
+    int descriptor = open(path, O_RDONLY);
+    struct stat interface_stat;
+    if (descriptor >= 0 && !fstat(descriptor, &interface_stat) && interface_stat.st_size > 0) {
+        void *bytes = mmap(NULL, interface_stat.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (bytes != MAP_FAILED) {
+            if (isValidInterface(bytes, interface_stat.st_size)) {
+                interface->bytes = bytes;
+                interface->size = interface_stat.st_size;
+                interface->isMapped = 1;
+                
+                //the source is the interface path without its final 'i', a class without source never changes.
+                //A source changed within the same clock tick as the interface was written counts as newer
+                struct stat source_stat;
+                path[strlen(path) - 1] = '\0';
+                struct timespec interfaceTime = modificationTime(&interface_stat);
+                struct timespec sourceTime = stat(path, &source_stat) ? (struct timespec){0, 0} : modificationTime(&source_stat);
+                interface->isCurrent = sourceTime.tv_sec < interfaceTime.tv_sec ||
+                                       (sourceTime.tv_sec == interfaceTime.tv_sec && sourceTime.tv_nsec < interfaceTime.tv_nsec);
+                strcat(path, "i");
+            } else {
+                munmap(bytes, interface_stat.st_size);
+            }
+        }
+    }
+    if (descriptor >= 0) {
+        close(descriptor);
+    }
+    
+    return interface;
+}
+
+ClassInterface *classInterfaceWithName(char *className) {
+    const char *separator = strrchr(currentInputPath, '/');
+    size_t directoryLength = separator ? separator - currentInputPath + 1 : 0;
+    char *path = malloc(directoryLength + strlen(className) + strlen(".jacki") + 1);
+    memcpy(path, currentInputPath, directoryLength);
+    strcpy(path + directoryLength, className);
+    strcat(path, ".jacki");
+    
+    ClassInterface *interface = NULL;
+    for (size_t i = 0; i < number_of_class_interfaces && !interface; i++) {
+        if (!strcmp(class_interfaces[i].path, path)) {
+            interface = &class_interfaces[i];
+        }
+    }
+    if (interface) {
+        free(path);
+    } else {
+        interface = mapClassInterface(path);
+    }
+    
+    //purity is transitive, so the subroutines this class took to be pure must still be. Looking them up may load
+    //more interfaces and move this one, and a cycle back to it finds it not current while it is being checked
+    if (!interface->isChecked && interface->isCurrent) {
+        size_t index = interface - class_interfaces;
+        interface->isCurrent = 0;
+        
+        InterfaceHeader *header = (InterfaceHeader *)interface->bytes;
+        InterfaceDependency *dependencies = (InterfaceDependency *)(interface->bytes + interface->size - header->length_of_strings) - header->number_of_dependencies;
+        char *strings = (char *)interface->bytes + interface->size - header->length_of_strings;
+        int isCurrent = 1;
+        for (uint32_t i = 0; i < header->number_of_dependencies && isCurrent; i++) {
+            uint32_t kind = 0;
+            uint32_t number_of_parameters = 0;
+            uint32_t isPure = 0;
+            int isKnownClass = 0;
+            isCurrent = findSubroutine(strings + dependencies[i].className, strings + dependencies[i].subroutineName, &kind, &number_of_parameters, &isPure, &isKnownClass) && isPure;
+        }
+        
+        interface = &class_interfaces[index];
+        interface->isCurrent = isCurrent;
+    }
+    interface->isChecked = 1;
+    
+    return interface;
+}
+
+//an interface written during this run replaces whatever was mapped for it before, and whether the interfaces
+//depending on it are current is decided again
+void forgetClassInterfaces() {
+    for (size_t i = 0; i < number_of_class_interfaces; i++) {
+        ClassInterface *interface = &class_interfaces[i];
+        if (interface->isMapped) {
+            munmap(interface->bytes, interface->size);
+        }
+        free(interface->path);
+    }
+    free(class_interfaces);
+    class_interfaces = NULL;
+    number_of_class_interfaces = 0;
+}
+
+//looks the subroutine up in the class being compiled or in the interface file of another class,
+//returning 0 when nothing is known about it
+int findSubroutine(char *className, char *subName, uint32_t *kind, uint32_t *number_of_parameters, uint32_t *isPure, int *isKnownClass) {
+    *isKnownClass = 0;
+    if (!strcmp(className, currentClass)) {
+        for (size_t i = 0; i < number_of_class_subroutines; i++) {
+            if (!strcmp(class_subroutines[i].name, subName)) {
+                *kind = interfaceKind(class_subroutines[i].kind);
+                *number_of_parameters = class_subroutines[i].number_of_parameters;
+                *isPure = class_subroutines[i].isPure;
+                return 1;
+            }
+        }
+        return 0;
+    }
+    
+    ClassInterface *interface = classInterfaceWithName(className);
+    if (!interface->bytes) { return 0; }
+    *isKnownClass = 1;
+    
+    InterfaceHeader *header = (InterfaceHeader *)interface->bytes;
+    InterfaceSubroutine *subroutines = (InterfaceSubroutine *)(interface->bytes + sizeof(InterfaceHeader) + header->number_of_variables * sizeof(InterfaceVariable));
+    char *strings = (char *)interface->bytes + interface->size - header->length_of_strings;
+    for (uint32_t i = 0; i < header->number_of_subroutines; i++) {
+        if (!strcmp(strings + subroutines[i].name, subName)) {
+            *kind = subroutines[i].kind;
+            *number_of_parameters = subroutines[i].number_of_parameters;
+            *isPure = interface->isCurrent && subroutines[i].isPure;
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+void checkSubroutineCall(char *className, char *subName, int argumentCount, int isMethodCall) {
+    if (!options.useInterfaces) { return; }
+    
+    uint32_t kind = 0;
+    uint32_t number_of_parameters = 0;
+    uint32_t isPure = 0;
+    int isKnownClass = 0;
+    if (!findSubroutine(className, subName, &kind, &number_of_parameters, &isPure, &isKnownClass)) {
+        if (isKnownClass) {
+            printf("Warning: class '%s' has no subroutine '%s'!\n", className, subName);
+        }
+        return;
+    }
+    
+    int isMethod = kind == 2;
+    if (isMethod != isMethodCall) {
+        printf("Warning: '%s.%s' is %s!\n", className, subName, isMethod ? "a method but is called without an object" : "not a method but is called on an object");
+    } else if (number_of_parameters + isMethod != argumentCount) {
+        printf("Warning: '%s.%s' expects %u arguments, not %d!\n", className, subName, number_of_parameters, argumentCount - isMethod);
+    }
+}
+
+//OS subroutines that only compute a value from their arguments
+const char *pureSystemSubroutines[] = {"Math.multiply", "Math.divide", "Math.abs", "Math.min", "Math.max", "Math.sqrt"};
+
+//whether calls to the subroutine can be reordered or reused, other classes have to say so in a current interface file
+int isPureSubroutine(char *className, char *subName) {
+    for (int i = 0; i < sizeof(pureSystemSubroutines) / sizeof(pureSystemSubroutines[0]); i++) {
+        const char *name = pureSystemSubroutines[i];
+        size_t length = strlen(className);
+        if (!strncmp(name, className, length) && name[length] == '.' && !strcmp(name + length + 1, subName)) { return 1; }
+    }
+    if (strcmp(className, currentClass) && !options.useInterfaces) { return 0; }
+    
+    uint32_t kind = 0;
+    uint32_t number_of_parameters = 0;
+    uint32_t isPure = 0;
+    int isKnownClass = 0;
+    if (!findSubroutine(className, subName, &kind, &number_of_parameters, &isPure, &isKnownClass) || !isPure) { return 0; }
+    
+    //the interface of this class has to list what its purity rests on
+    if (strcmp(className, currentClass)) {
+        for (size_t i = 0; i < number_of_pure_dependencies; i++) {
+            if (!strcmp(pure_dependencies[i].className, className) && !strcmp(pure_dependencies[i].subroutineName, subName)) { return 1; }
+        }
+        pure_dependencies = realloc(pure_dependencies, (number_of_pure_dependencies + 1) * sizeof(PureDependency));
+        pure_dependencies[number_of_pure_dependencies++] = (PureDependency){copyString(className), copyString(subName)};
+    }
+    return 1;
+}
+
+#pragma mark Compile Functions
+
+//code compiled out of place for a profiled branch layout, kept on a stack so resetCompilerState can free it after an error
+typedef struct BranchBuffer {
+    FILE *file;
+    char *bytes;
+    size_t size;
+} BranchBuffer;
+
+BranchBuffer **branch_buffers;
+size_t number_of_branch_buffers;
+
+FILE *openBranchBuffer() {
+    branch_buffers = realloc(branch_buffers, (number_of_branch_buffers + 1) * sizeof(BranchBuffer *));
+    BranchBuffer *buffer = calloc(1, sizeof(BranchBuffer));
+    buffer->file = open_memstream(&buffer->bytes, &buffer->size);
+    branch_buffers[number_of_branch_buffers++] = buffer;
+    
+    return buffer->file;
+}
+
+//closes the innermost branch buffer and appends what was compiled into it to outputFile
+void writeBranchBuffer(FILE *outputFile) {
+    BranchBuffer *buffer = branch_buffers[--number_of_branch_buffers];
+    fclose(buffer->file);
+    fwrite(buffer->bytes, 1, buffer->size, outputFile);
+    free(buffer->bytes);
+    free(buffer);
+}
+
+void freeBranchBuffers() {
+    while (number_of_branch_buffers) {
+        BranchBuffer *buffer = branch_buffers[--number_of_branch_buffers];
+        fclose(buffer->file);
+        free(buffer->bytes);
+        free(buffer);
+    }
+    free(branch_buffers);
+    branch_buffers = NULL;
+}
+
+int compileVarBody(FILE *inputFile, FILE *outputFile, Symbol *newSymbol, Symbol ***symbolTable) {
+    char line[256];
+    
+    fgets_nl(line, sizeof(line), inputFile);
+    TokenType lineType = tokenType(line);
+    if (lineType == TokenTypeIdentifier || !strcmp(line, "int") || !strcmp(line, "char") || !strcmp(line, "boolean")) {
+        newSymbol->type = malloc(strlen(line) + 1);
+        strcpy(newSymbol->type, line);
+    } else {
+        compileError("Var declaration does not have a valid type!\n");
+    }
+    
+    int variableCount = 0;
+    while (1) {
+        fgets_nl(line, sizeof(line), inputFile);
+        if (tokenType(line) == TokenTypeIdentifier) {
+            newSymbol->name = malloc(strlen(line) + 1);
+            strcpy(newSymbol->name, line);
+        } else {
+            compileError("Var name must be of token type 'identifier'!\n");
+        }
+        
+        variableCount++;
+        
+        fgets_nl(line, sizeof(line), inputFile);
+        if (!strcmp(line, ";")) {
+            break;
+        } else if (!strcmp(line, ",")) {
+            char *kind = newSymbol->kind;
+            char *type = newSymbol->type;
+            
+            newSymbol = calloc(1, sizeof(Symbol));
+            newSymbol->kind = malloc(strlen(kind) + 1);
+            strcpy(newSymbol->kind, kind);
+            newSymbol->type = malloc(strlen(type) + 1);
+            strcpy(newSymbol->type, type);
+            
+            *symbolTable = add_symbol(*symbolTable, newSymbol);
+        } else {
+            compileError("Expected ';' at end of line of var declaration(s)!\n");
+        }
+    }
+    
+    return variableCount;
+}
+
+void compileClassVarDeclaration(char *varType, FILE *inputFile, FILE *outputFile) {
+    Symbol *newSymbol = calloc(1, sizeof(Symbol));
+    newSymbol->kind = malloc(strlen(varType) + 1);
+    strcpy(newSymbol->kind, varType);
+    class_symbols = add_symbol(class_symbols, newSymbol);
+    
+    compileVarBody(inputFile, outputFile, newSymbol, &class_symbols);
+}
+
+int compileVarDeclaration(FILE *inputFile, FILE *outputFile) {
+    Symbol *newSymbol = calloc(1, sizeof(Symbol));
+    char *kind = "var";
+    newSymbol->kind = malloc(strlen(kind) + 1);
+    strcpy(newSymbol->kind, kind);
+    sub_symbols = add_symbol(sub_symbols, newSymbol);
+    
+    return compileVarBody(inputFile, outputFile, newSymbol, &sub_symbols);
+}
+
+void compileParameterList(FILE *inputFile, FILE *outputFile) {
+    char line[256];
+    
+    while (1) {
+        fpos_t pos;
+        fgetpos(inputFile, &pos);
+        
+        if (!fgets_nl(line, sizeof(line), inputFile)) {
+            compileError("Unexpected end of file in parameter list!\n");
+        }
+        
+        if (!strcmp(line, ",")) {
+            //do nothing
+        } else if (!strcmp(line, ")")) {
+            fsetpos(inputFile, &pos);
+            break;
+        } else {
+            Symbol *newSymbol = calloc(1, sizeof(Symbol));
+            char *kind = "argument";
+            newSymbol->kind = malloc(strlen(kind) + 1);
+            strcpy(newSymbol->kind, kind);
+            sub_symbols = add_symbol(sub_symbols, newSymbol);
+            
+            TokenType lineType = tokenType(line);
+            if (lineType == TokenTypeIdentifier || !strcmp(line, "int") || !strcmp(line, "char") || !strcmp(line, "boolean") || !strcmp(line, "void")) {
+                newSymbol->type = malloc(strlen(line) + 1);
+                strcpy(newSymbol->type, line);
+            } else {
+                compileError("Subroutine parameter does not have a valid type!\n");
+            }
+            
+            fgets_nl(line, sizeof(line), inputFile);
+            if (tokenType(line) == TokenTypeIdentifier) {
+                newSymbol->name = malloc(strlen(line) + 1);
+                strcpy(newSymbol->name, line);
+            } else {
+                compileError("Subroutine parameter does not have a valid name!\n");
+            }
+        }
+    }
+}
+
+Expression *newExpression(ExpressionType type) {
+    if (number_of_expression_nodes == length_of_expression_nodes) {
+        length_of_expression_nodes = length_of_expression_nodes ? length_of_expression_nodes * 2 : 64;
+        expression_nodes = realloc(expression_nodes, length_of_expression_nodes * sizeof(Expression *));
+    }
+    
+    Expression *expression = calloc(1, sizeof(Expression));
+    expression->type = type;
+    expression->need = 1;
+    expression->isPure = 1;
+    expression->temporary = -1;
+    expression_nodes[number_of_expression_nodes++] = expression;
+    return expression;
+}
+
+void freeExpressionNodes() {
+    for (size_t i = 0; i < number_of_expression_nodes; i++) {
+        Expression *expression = expression_nodes[i];
+        free(expression->text);
+        free(expression->operands);
+        free(expression->operations);
+        free(expression->isSwapped);
+        free(expression);
+    }
+    number_of_expression_nodes = 0;
+}
+
+//operation combines the expression so far with a chain operand, it is NULL for other operands
+void addOperand(Expression *expression, Expression *operand, char *operation) {
+    int count = expression->number_of_operands++;
+    if (!(count & (count - 1))) {
+        int length = count ? count * 2 : 1;
+        expression->operands = realloc(expression->operands, length * sizeof(Expression *));
+        if (operation) {
+            expression->operations = realloc(expression->operations, length * sizeof(char *));
+        }
+    }
+    
+    expression->operands[count] = operand;
+    if (operation) {
+        expression->operations[count - 1] = operation;
+    }
+    expression->isPure = expression->isPure && operand->isPure;
+}
+
+//the operation that gives the same result with its operands the other way around, or NULL
+char *commutedOperation(char *operation) {
+    if (!strcmp(operation, "lt")) { return "gt"; }
+    if (!strcmp(operation, "gt")) { return "lt"; }
+    if (!strcmp(operation, "sub") || !strcmp(operation, "call Math.divide 2")) { return NULL; }
+    return operation;
+}
+
+uint32_t hashString(uint32_t hash, const char *string) {
+    while (*string) {
+        hash = hash * 31 + (unsigned char)*string++;
+    }
+    return hash;
+}
+
+//works out the stack slots a finished expression needs and its hash, from those of its operands.
+//A commutative chain step evaluates its operand first when that needs more slots than the chain before it,
+//as long as neither calls anything with side effects.
+void finishExpression(Expression *expression) {
+    uint32_t hash = expression->type * 31 + expression->value;
+    hash = hash * 31 + (uint32_t)(uintptr_t)expression->symbol;
+    hash = hash * 31 + (uint32_t)(uintptr_t)expression->indexSymbol;
+    if (expression->text) {
+        hash = hashString(hash, expression->text);
+    }
+    for (int i = 0; i < expression->number_of_operands; i++) {
+        hash = hash * 31 + expression->operands[i]->hash;
+        if (expression->operations && i > 0) {
+            hash = hashString(hash, expression->operations[i - 1]);
+        }
+    }
+    expression->hash = hash;
+    
+    Expression **operands = expression->operands;
+    switch (expression->type) {
+        case ExpressionString:
+            expression->need = 2;
+            break;
+        case ExpressionArray:
+            if (expression->number_of_operands) {
+                expression->need = operands[0]->need + 1 > 2 ? operands[0]->need + 1 : 2;
+            } else {
+                expression->need = expression->indexSymbol ? 2 : 1;
+            }
+            break;
+        case ExpressionCall:
+            expression->need = 1;
+            for (int i = 0; i < expression->number_of_operands; i++) {
+                if (i + operands[i]->need > expression->need) {
+                    expression->need = i + operands[i]->need;
+                }
+            }
+            break;
+        case ExpressionUnary:
+            expression->need = operands[0]->need;
+            break;
+        case ExpressionChain:
+        {
+            free(expression->isSwapped);
+            expression->isSwapped = calloc(expression->number_of_operands, 1);
+            
+            int need = operands[0]->need;
+            int isPure = operands[0]->isPure;
+            for (int i = 1; i < expression->number_of_operands; i++) {
+                Expression *operand = operands[i];
+                if (options.optimize && isPure && operand->isPure && operand->need > need && commutedOperation(expression->operations[i - 1])) {
+                    expression->isSwapped[i - 1] = 1;
+                    need = operand->need > need + 1 ? operand->need : need + 1;
+                } else {
+                    need = need > operand->need + 1 ? need : operand->need + 1;
+                }
+                isPure = isPure && operand->isPure;
+            }
+            expression->need = need;
+            break;
+        }
+        default:
+            expression->need = 1;
+            break;
+    }
+}
+
+Expression *parseExpression(FILE *inputFile);
+
+void parseExpressionList(FILE *inputFile, Expression *call) {
+    char line[256];
+    
+    while (1) {
+        fpos_t pos;
+        fgetpos(inputFile, &pos);
+        
+        fgets_nl(line, sizeof(line), inputFile);
+        if (!strcmp(line, ")")) {
+            fsetpos(inputFile, &pos);
+            break;
+        } else if (!strcmp(line, ",")) {
+            //do nothing
+        } else {
+            fsetpos(inputFile, &pos);
+            addOperand(call, parseExpression(inputFile), NULL);
+        }
+    }
+}
+
+Expression *parseSubroutineCall(FILE *inputFile) {
+    char line[256];
+    
+    fgets_nl(line, sizeof(line), inputFile);
+    if (tokenType(line) != TokenTypeIdentifier) {
+        compileError("Expected identifier at beginning of subroutine call!\n");
+    }
+    
+    char subFirst[256];
+    strcpy(subFirst, line);
+    
+    Expression *call = newExpression(ExpressionCall);
+    char *className = currentClass;
+    char subName[256];
+    
+    fgets_nl(line, sizeof(line), inputFile);
+    if (!strcmp(line, "(")) {
+        strcpy(subName, subFirst);
+        call->isMethodCall = 1;
+        addOperand(call, newExpression(ExpressionThis), NULL);
+    } else if (!strcmp(line, ".")) {
+        Symbol *symbol = symbolWithName(subFirst);
+        className = subFirst;
+        if (symbol) {
+            className = symbol->type;
+            call->isMethodCall = 1;
+            Expression *object = newExpression(ExpressionVariable);
+            object->symbol = symbol;
+            finishExpression(object);
+            addOperand(call, object, NULL);
+        }
+        
+        fgets_nl(line, sizeof(line), inputFile);
+        if (tokenType(line) != TokenTypeIdentifier) {
+            compileError("Invalid subroutine name!\n");
+        }
+        strcpy(subName, line);
+        
+        fgets_nl(line, sizeof(line), inputFile);
+        if (strcmp(line, "(")) {
+            compileError("Invalid subroutine name!\n");
+        }
+    } else {
+        compileError("Expected '(' or '.' after subroutine call!\n");
+    }
+    
+    parseExpressionList(inputFile, call);
+    
+    fgets_nl(line, sizeof(line), inputFile);
+    if (strcmp(line, ")")) {
+        compileError("Expected ')' to end expression list!\n");
+    }
+    
+    call->text = malloc(strlen(className) + strlen(subName) + 2);
+    sprintf(call->text, "%s.%s", className, subName);
+    checkSubroutineCall(className, subName, call->number_of_operands, call->isMethodCall);
+    call->isPure = call->isPure && isPureSubroutine(className, subName);
+    finishExpression(call);
+    
+    return call;
+}
+
+Expression *parseTerm(FILE *inputFile) {
+    char line[256];
+    
+    if (++termDepth > maximumTermDepth) {
+        compileError("Expression is nested too deeply!\n");
+    }
+
+    fpos_t initialTermPos;
+    fgetpos(inputFile, &initialTermPos);
+    
+    Expression *term = NULL;
+    fgets_nl(line, sizeof(line), inputFile);
+    TokenType termType = tokenType(line);
+    switch (termType) {
+        case TokenTypeString:
+            term = newExpression(ExpressionString);
+            term->text = copyString(line);
+            term->isPure = 0; //String.new allocates
+            break;
+        case TokenTypeInteger:
+            term = newExpression(ExpressionConstant);
+            term->value = integerConstant(line);
+            break;
+        case TokenTypeKeyword:
+            if (!strcmp("true", line)) {
+                term = newExpression(ExpressionTrue);
+            } else if (!strcmp("false", line) || !strcmp("null", line)) {
+                term = newExpression(ExpressionConstant);
+            } else if (!strcmp("this", line)) {
+                term = newExpression(ExpressionThis);
+            } else {
+                compileError("Unrecognized keyword used as term: %s!\n", line);
+            }
+            break;
+        case TokenTypeIdentifier:
+        {
+            fgets_nl(line, sizeof(line), inputFile);
+            fsetpos(inputFile, &initialTermPos); //TODO: this is weird and hacky
+            if (!strcmp(line, "[")) {
+                fgets_nl(line, sizeof(line), inputFile);
+                Symbol *symbol = symbolWithName(line);
+                if (!symbol) {
+                    compileError("Variable '%s' could not be found in the symbol table!\n", line);
+                }
+                
+                fgets_nl(line, sizeof(line), inputFile);
+                
+                term = newExpression(ExpressionArray);
+                term->symbol = symbol;
+                ArrayIndexType indexType = scanArrayIndex(inputFile, &term->value, &term->indexSymbol);
+                if (indexType == ArrayIndexExpression) {
+                    addOperand(term, parseExpression(inputFile), NULL);
+                    
+                    fgets_nl(line, sizeof(line), inputFile);
+                    if (strcmp(line, "]")) {
+                        compileError("Expected ']' to end expression, not '%s'!\n", line);
+                    }
+                }
+            } else if (!strcmp(line, "(") || !strcmp(line, ".")) {
+                term = parseSubroutineCall(inputFile);
+            } else {
+                fgets_nl(line, sizeof(line), inputFile);
+                
+                Symbol *symbol = symbolWithName(line);
+                if (!symbol) {
+                    compileError("Variable '%s' could not be found in the symbol table!\n", line);
+                }
+                
+                term = newExpression(ExpressionVariable);
+                term->symbol = symbol;
+            }
+            break;
+        }
+        case TokenTypeSymbol:
+            if (!strcmp(line, "(")) {
+                term = parseExpression(inputFile);
+                
+                fgets_nl(line, sizeof(line), inputFile);
+                if (strcmp(line, ")")) {
+                    compileError("Expected ')' to end expression!\n");
+                }
+            } else if (!strcmp(line, "-") || !strcmp(line, "~")) {
+                term = newExpression(ExpressionUnary);
+                addOperand(term, parseTerm(inputFile), NULL);
+                
+                term->operations = malloc(sizeof(char *));
+                term->operations[0] = !strcmp(line, "-") ? "neg" : "not";
+            } else {
+                compileError("Expected a term, not '%s'!\n", line);
+            }
+            break;
+        default:
+            compileError("Invalid token type!\n");
+            break;
+    }
+    finishExpression(term);
+    
+    termDepth--;
+    return term;
+}
+
+//a chain of terms combined left to right, as Jack has no operator precedence
+Expression *parseExpression(FILE *inputFile) {
+    char line[256];
+    
+    Expression *first = parseTerm(inputFile);
+    Expression *chain = NULL;
+    while (1) {
+        fpos_t pos;
+        fgetpos(inputFile, &pos);
+        
+        char *operation = NULL;
+        fgets_nl(line, sizeof(line), inputFile);
+        if (!strcmp(line, "+")) {
+            operation = "add";
+        } else if (!strcmp(line, "-")) {
+            operation = "sub";
+        } else if (!strcmp(line, "*")) {
+            operation = "call Math.multiply 2";
+        } else if (!strcmp(line, "/")) {
+            operation = "call Math.divide 2";
+        } else if (!strcmp(line, "&amp;")) {
+            operation = "and";
+        } else if (!strcmp(line, "|")) {
+            operation = "or";
+        } else if (!strcmp(line, "&lt;")) {
+            operation = "lt";
+        } else if (!strcmp(line, "&gt;")) {
+            operation = "gt";
+        } else if (!strcmp(line, "=")) {
+            operation = "eq";
+        } else {
+            fsetpos(inputFile, &pos);
+            break;
+        }
+        
+        if (!chain) {
+            chain = newExpression(ExpressionChain);
+            addOperand(chain, first, NULL);
+        }
+        addOperand(chain, parseTerm(inputFile), operation);
+    }
+    
+    if (!chain) { return first; }
+    finishExpression(chain);
+    return chain;
+}
+
+int isSameExpression(Expression *expression, Expression *other) {
+    if (expression->hash != other->hash || expression->type != other->type || expression->value != other->value ||
+        expression->symbol != other->symbol || expression->indexSymbol != other->indexSymbol ||
+        expression->number_of_operands != other->number_of_operands || !expression->text != !other->text ||
+        (expression->text && strcmp(expression->text, other->text))) { return 0; }
+    
+    for (int i = 0; i < expression->number_of_operands; i++) {
+        if (!isSameExpression(expression->operands[i], other->operands[i])) { return 0; }
+        if (expression->operations && (i < expression->number_of_operands - 1 || expression->type == ExpressionUnary) &&
+            strcmp(expression->operations[i], other->operations[i])) { return 0; }
+    }
+    return 1;
+}
+
+const int maximumReusableExpressions = 64;
+
+void findReusableExpressions(Expression *expression, Expression **candidates, int *number_of_candidates) {
+    if (*number_of_candidates == maximumReusableExpressions) { return; }
+    
+    if (expression->type == ExpressionArray || (expression->type == ExpressionCall && expression->isPure)) {
+        candidates[(*number_of_candidates)++] = expression;
+    }
+    for (int i = 0; i < expression->number_of_operands; i++) {
+        findReusableExpressions(expression->operands[i], candidates, number_of_candidates);
+    }
+}
+
+//points repeated array reads and pure calls at the first one, whose value is then kept in a local for the others.
+//Only parts that call nothing with side effects are searched, so nothing can change memory between the repeats.
+void reuseExpressions(Expression *expression) {
+    Expression *candidates[maximumReusableExpressions];
+    int number_of_candidates = 0;
+    if (expression->isPure) {
+        findReusableExpressions(expression, candidates, &number_of_candidates);
+    } else if (expression->type == ExpressionCall) {
+        //the arguments of a call are all evaluated before it
+        for (int i = 0; i < expression->number_of_operands; i++) {
+            if (!expression->operands[i]->isPure) { return; }
+        }
+        for (int i = 0; i < expression->number_of_operands; i++) {
+            findReusableExpressions(expression->operands[i], candidates, &number_of_candidates);
+        }
+    }
+    
+    int number_of_arrays = 0;
+    for (int i = 0; i < number_of_candidates; i++) {
+        Expression *candidate = candidates[i];
+        for (int j = 0; j < i; j++) {
+            if (!candidates[j]->original && isSameExpression(candidates[j], candidate)) {
+                candidate->original = candidates[j];
+                candidates[j]->uses++;
+                break;
+            }
+        }
+        if (!candidate->original) {
+            candidate->uses = 1;
+            number_of_arrays += candidate->type == ExpressionArray;
+        }
+    }
+    
+    //when a single array is read, pointer 1 still points at it for the repeats, which is cheaper than a local
+    if (number_of_arrays == 1) {
+        for (int i = 0; i < number_of_candidates; i++) {
+            if (candidates[i]->type == ExpressionArray && !candidates[i]->number_of_operands) {
+                candidates[i]->uses = 1;
+            }
+        }
+    }
+}
+
+void writeExpression(FILE *outputFile, Expression *expression);
+
+//writes operands 0 to last of a chain, evaluating a swapped step's operand before everything in front of it
+void writeChain(FILE *outputFile, Expression *chain, int last) {
+    int first = last;
+    while (first > 0 && !chain->isSwapped[first - 1]) {
+        first--;
+    }
+    
+    if (first > 0) {
+        writeExpression(outputFile, chain->operands[first]);
+        writeChain(outputFile, chain, first - 1);
+        fprintf(outputFile, "%s\n", commutedOperation(chain->operations[first - 1]));
+    } else {
+        writeExpression(outputFile, chain->operands[0]);
+    }
+    
+    for (int i = first + 1; i <= last; i++) {
+        writeExpression(outputFile, chain->operands[i]);
+        fprintf(outputFile, "%s\n", chain->operations[i - 1]);
+    }
+}
+
+void writeExpression(FILE *outputFile, Expression *expression) {
+    Expression *original = expression->original ? expression->original : expression;
+    if (original->temporary >= 0) {
+        fprintf(outputFile, "push local %d\n", original->temporary);
+        return;
+    }
+    
+    switch (expression->type) {
+        case ExpressionConstant:
+            fprintf(outputFile, "push constant %d\n", expression->value);
+            break;
+        case ExpressionTrue:
+            fputs("push constant 1\nneg\n", outputFile);
+            break;
+        case ExpressionThis:
+            fputs("push pointer 0\n", outputFile);
+            break;
+        case ExpressionString:
+        {
+            char *text = expression->text;
+            fprintf(outputFile, "push constant %lu\ncall String.new 1\n", strlen(text)-2); //ignore '"'
+            for (int i = 0; i < strlen(text) - 1; i++) {
+                char c = text[i];
+                if (c != '"') {
+                    fprintf(outputFile, "push constant %d\ncall String.appendChar 2\n", c);
+                }
+            }
+            break;
+        }
+        case ExpressionVariable:
+            writeSymbol(outputFile, "push", expression->symbol);
+            break;
+        case ExpressionArray:
+            if (expression->number_of_operands) {
+                writeSymbol(outputFile, "push", expression->symbol);
+                writeExpression(outputFile, expression->operands[0]);
+                fputs("add\n", outputFile);
+                fputs("pop pointer 1\npush that 0\n", outputFile);
+                invalidateThatPointer();
+            } else {
+                writeThatPointer(outputFile, expression->symbol, expression->indexSymbol);
+                fprintf(outputFile, "push that %d\n", expression->value);
+            }
+            break;
+        case ExpressionCall:
+            for (int i = 0; i < expression->number_of_operands; i++) {
+                writeExpression(outputFile, expression->operands[i]);
+            }
+            fprintf(outputFile, "call %s %d\n", expression->text, expression->number_of_operands);
+            
+            //a pure call changes no field or static that pointer 1 was computed from
+            if (!expression->isPure) {
+                invalidateThatPointerAfterCall();
+            }
+            break;
+        case ExpressionUnary:
+            writeExpression(outputFile, expression->operands[0]);
+            fprintf(outputFile, "%s\n", expression->operations[0]);
+            break;
+        case ExpressionChain:
+            writeChain(outputFile, expression, expression->number_of_operands - 1);
+            break;
+    }
+    
+    if (original->uses > 1) {
+        original->temporary = firstTemporaryLocal + number_of_temporary_locals++;
+        fprintf(outputFile, "pop local %d\npush local %d\n", original->temporary, original->temporary);
+    }
+}
+
+//writes a parsed expression, keeping repeated parts in locals when optimizing, and frees its nodes
+void writeParsedExpression(FILE *outputFile, Expression *expression) {
+    if (options.optimize) {
+        reuseExpressions(expression);
+    }
+    number_of_temporary_locals = 0;
+    writeExpression(outputFile, expression);
+    freeExpressionNodes();
+}
+
+void compileSubroutineCall(FILE *inputFile, FILE *outputFile, int hasReturn) {
+    writeParsedExpression(outputFile, parseSubroutineCall(inputFile));
+    
+    if (!hasReturn) {
+        fputs("pop temp 0\n", outputFile);
+    }
+}
+
+void compileExpression(FILE *inputFile, FILE *outputFile) {
+    writeParsedExpression(outputFile, parseExpression(inputFile));
+}
+
+//a subroutine is pure when it stores only into its own frame and calls only pure subroutines
+int isPureBuffer(char *buffer) {
+    char *line = buffer;
+    while (line && *line) {
+        if (!strncmp(line, "pop static ", 11) || !strncmp(line, "pop this ", 9) || !strncmp(line, "pop that ", 9)) { return 0; }
+        
+        if (!strncmp(line, "call ", 5)) {
+            char name[512];
+            size_t length = strcspn(line + 5, " \n");
+            if (length >= sizeof(name)) { return 0; }
+            memcpy(name, line + 5, length);
+            name[length] = '\0';
+            
+            char *dot = strchr(name, '.');
+            if (!dot) { return 0; }
+            
+            *dot = '\0';
+            if (!isPureSubroutine(name, dot + 1)) { return 0; }
+        }
+        
+        line = strchr(line, '\n');
+        if (line) {
+            line++;
+        }
+    }
+    return 1;
+}
+
+void compileStatements(FILE *inputFile, FILE *outputFile) {
+    char line[256];
+
+    while (1) {
+        fpos_t pos;
+        fgetpos(inputFile, &pos);
+        
+        writeSourcePosition(inputFile, outputFile);
+        fgets_nl(line, sizeof(line), inputFile);
+        if (!strcmp(line, "let") || !strcmp(line, "if") || !strcmp(line, "while") || !strcmp(line, "do") || !strcmp(line, "return")) {
+            char statementType[8];
+            strcpy(statementType, line);
+
+            if (!strcmp(line, "let")) {
+                fgets_nl(line, sizeof(line), inputFile);
+                Symbol *symbol = NULL;
+                if (tokenType(line) == TokenTypeIdentifier) {
                     symbol = symbolWithName(line);
                     if (!symbol) {
-                        printf("Variable '%s' could not be found in the symbol table!\n", line);
-                        exit(1);
+                        compileError("Variable '%s' could not be found in the symbol table!\n", line);
+                    }
+                } else {
+                    compileError("Local var name must be of token type 'identifier'!\n");
+                }
+
+                fgets_nl(line, sizeof(line), inputFile);
+                int offset = 0;
+                int isDeferred = 0;
+                int constantIndex = 0;
+                Symbol *indexSymbol = NULL;
+                if (!strcmp(line, "[")) {
+                    offset = 1;
+                    ArrayIndexType indexType = scanArrayIndex(inputFile, &constantIndex, &indexSymbol);
+                    
+                    //the right hand side cannot change a local or argument, so the address can be computed after it
+                    isDeferred = indexType != ArrayIndexExpression && isCallStable(symbol) && (!indexSymbol || isCallStable(indexSymbol));
+                    if (!isDeferred) {
+                        writeSymbol(outputFile, "push", symbol);
+                        
+                        if (indexType == ArrayIndexExpression) {
+                            compileExpression(inputFile, outputFile);
+                            
+                            fgets_nl(line, sizeof(line), inputFile);
+                            if (strcmp(line, "]")) {
+                                compileError("Expected ']' to end expression!\n");
+                            }
+                        } else if (indexType == ArrayIndexVariable) {
+                            writeSymbol(outputFile, "push", indexSymbol);
+                        }
+                        
+                        if (indexType != ArrayIndexConstant) {
+                            fputs("add\n", outputFile);
+                        }
+                    }
+                    
+                    fgets_nl(line, sizeof(line), inputFile);
+                }
+                
+                if (strcmp(line, "=")) {
+                    compileError("Expected '=' after let statement declaration!\n");
+                }
+                
+                compileExpression(inputFile, outputFile);
+                if (isDeferred) {
+                    writeThatPointer(outputFile, symbol, indexSymbol);
+                    fprintf(outputFile, "pop that %d\n", constantIndex);
+                } else if (offset) {
+                    fprintf(outputFile, "pop temp 0\npop pointer 1\npush temp 0\npop that %d\n", constantIndex);
+                    invalidateThatPointer();
+                } else {
+                    writeSymbol(outputFile, "pop", symbol);
+                    invalidateThatPointerForSymbol(symbol);
+                }
+                
+                fgets_nl(line, sizeof(line), inputFile);
+                if (strcmp(line, ";")) {
+                    compileError("Expected ';' at end of 'let' statement, not '%s'!\n", line);
+                }
+            } else if (!strcmp(line, "if")) {
+                BranchProfile *profile = nextBranchProfile();
+                
+                fgets_nl(line, sizeof(line), inputFile);
+                if (strcmp(line, "(")) {
+                    compileError("Expected '(' at beginning of %s expression!\n", statementType);
+                }
+                
+                compileExpression(inputFile, outputFile);
+                
+                fgets_nl(line, sizeof(line), inputFile);
+                if (strcmp(line, ")")) {
+                    compileError("Expected ')' at end of %s expression!\n", statementType);
+                }
+                
+                //when the condition was ever true it jumps straight to the then statements, placed after the else statements.
+                //That drops the 'not' and saves one or two instructions whenever it is true, at no cost when it is false.
+                int isJumpingToThen = profile && profile->taken;
+                if (!isJumpingToThen) {
+                    fputs("not\n", outputFile);
+                }
+                
+                int label_1 = uniqueLabel();
+                writeLabel(outputFile, "if-goto", label_1);
+                
+                fgets_nl(line, sizeof(line), inputFile);
+                if (strcmp(line, "{")) {
+                    compileError("Expected '{' at beginning of %s statement!\n", statementType);
+                }
+                
+                compileStatements(inputFile, isJumpingToThen ? openBranchBuffer() : outputFile);
+                
+                fgets_nl(line, sizeof(line), inputFile);
+                if (strcmp(line, "}")) {
+                    compileError("Expected '}' at end of %s statement!\n", statementType);
+                }
+                
+                int label_2 = uniqueLabel();
+                if (!isJumpingToThen) {
+                    writeLabel(outputFile, "goto", label_2);
+                    writeLabel(outputFile, "label", label_1);
+                }
+                invalidateThatPointer();
+                
+                fpos_t pos;
+                fgetpos(inputFile, &pos);
+                
+                fgets_nl(line, sizeof(line), inputFile);
+                if (!strcmp(line, "else")) {
+                    fgets_nl(line, sizeof(line), inputFile);
+                    if (strcmp(line, "{")) {
+                        compileError("Expected '{' at beginning of 'else' statement!\n");
+                    }
+                    
+                    compileStatements(inputFile, outputFile);
+                    
+                    fgets_nl(line, sizeof(line), inputFile);
+                    if (strcmp(line, "}")) {
+                        compileError("Expected '}' at end of 'else' statement!\n");
                     }
                 } else {
-                    printf("Local var name must be of token type 'identifier'!\n");
-                    exit(1);
+                    fsetpos(inputFile, &pos);
+                }
+                
+                if (isJumpingToThen) {
+                    writeLabel(outputFile, "goto", label_2);
+                    writeLabel(outputFile, "label", label_1);
+                    writeBranchBuffer(outputFile);
+                }
+                
+                writeLabel(outputFile, "label", label_2);
+                invalidateThatPointer();
+            } else if (!strcmp(line, "while")) {
+                //a loop whose body ran is rotated to test its condition at the bottom,
+                //leaving one 'if-goto' per iteration instead of 'not', 'if-goto' and 'goto'
+                BranchProfile *profile = nextBranchProfile();
+                int isRotated = profile && profile->taken;
+                
+                FILE *conditionFile = outputFile;
+                int label_1 = uniqueLabel();
+                if (isRotated) {
+                    writeLabel(outputFile, "goto", label_1);
+                    conditionFile = openBranchBuffer();
+                } else {
+                    writeLabel(outputFile, "label", label_1);
+                }
+                invalidateThatPointer();
+                
+                fgets_nl(line, sizeof(line), inputFile);
+                if (strcmp(line, "(")) {
+                    compileError("Expected '(' at beginning of %s expression!\n", statementType);
+                }
+                
+                compileExpression(inputFile, conditionFile);
+                
+                fgets_nl(line, sizeof(line), inputFile);
+                if (strcmp(line, ")")) {
+                    compileError("Expected ')' at end of %s expression!\n", statementType);
+                }
+                
+                int label_2 = uniqueLabel();
+                if (isRotated) {
+                    writeLabel(outputFile, "label", label_2);
+                } else {
+                    fputs("not\n", outputFile);
+                    writeLabel(outputFile, "if-goto", label_2);
+                }
+                
+                fgets_nl(line, sizeof(line), inputFile);
+                if (strcmp(line, "{")) {
+                    compileError("Expected '{' at beginning of %s statement!\n", statementType);
+                }
+                
+                compileStatements(inputFile, outputFile);
+                
+                fgets_nl(line, sizeof(line), inputFile);
+                if (strcmp(line, "}")) {
+                    compileError("Expected '}' at end of %s statement!\n", statementType);
+                }
+                
+                if (isRotated) {
+                    writeLabel(outputFile, "label", label_1);
+                    writeBranchBuffer(outputFile);
+                    writeLabel(outputFile, "if-goto", label_2);
+                } else {
+                    writeLabel(outputFile, "goto", label_1);
+                    writeLabel(outputFile, "label", label_2);
+                }
+                invalidateThatPointer();
+            } else if (!strcmp(line, "do")) {
+                compileSubroutineCall(inputFile, outputFile, 0);
+                
+                fgets_nl(line, sizeof(line), inputFile);
+                if (strcmp(line, ";")) {
+                    compileError("Expected ';' at end of 'do' statement!\n");
+                }
+            } else if (!strcmp(line, "return")) {
+                fpos_t pos;
+                fgetpos(inputFile, &pos);
+                
+                fgets_nl(line, sizeof(line), inputFile);
+                if (strcmp(line, ";") != 0) {
+                    fsetpos(inputFile, &pos);
+                    compileExpression(inputFile, outputFile);
+                    
+                    fgets_nl(line, sizeof(line), inputFile);
+                } else {
+                    fputs("push constant 0\n", outputFile);
+                }
+                
+                if (strcmp(line, ";")) {
+                    compileError("Expected ';' at end of 'return' statement!\n");
                 }
+                
+                fputs("return\n", outputFile);
+            }
+        } else if (!strcmp(line, "}")) {
+            fsetpos(inputFile, &pos);
+            break;
+        } else {
+            compileError("Not a valid statement type: %s\n", line);
+        }
+    }
+}
+
+void compileSubroutineBody(FILE *inputFile, FILE *outputFile, char *subType) {
+    char line[256];
+    
+    fgets_nl(line, sizeof(line), inputFile);
+    if (strcmp(line, "{")) {
+        compileError("Subroutine Body should begin with '{'!\n");
+    }
+    
+    //compile local variables first
+    int varCount = 0;
+    while (1) {
+        fpos_t pos;
+        fgetpos(inputFile, &pos);
+        
+        fgets_nl(line, sizeof(line), inputFile);
+        if (!strcmp(line, "var")) {
+            varCount += compileVarDeclaration(inputFile, outputFile);
+        } else {
+            fsetpos(inputFile, &pos);
+            break;
+        }
+    }
+    
+    fprintf(outputFile, "%d\n", varCount);
+    invalidateThatPointer();
+    firstTemporaryLocal = varCount;
+    
+    if (!strcmp(subType, "method")) {
+        fputs("push argument 0\npop pointer 0\n", outputFile);
+    } else if (!strcmp(subType, "constructor")) {
+        fprintf(outputFile, "push constant %zu\ncall Memory.alloc 1\npop pointer 0\n", *number_of_class_symbols);
+    }
+
+    //compile statements
+    while (1) {
+        fpos_t pos;
+        fgetpos(inputFile, &pos);
+        
+        fgets_nl(line, sizeof(line), inputFile);
+        if (!strcmp(line, "}")) {
+            break;
+        } else if (!strcmp(line, "let") || !strcmp(line, "if") || !strcmp(line, "while") || !strcmp(line, "do") || !strcmp(line, "return")) {
+            fsetpos(inputFile, &pos);
+            compileStatements(inputFile, outputFile);
+        } else {
+            compileError("Unrecognized statement in subroutine body!\n");
+        }
+    }
+}
+
+void compileSubroutineDeclaration(char *subType, FILE *inputFile, FILE *outputFile) {
+    char line[256];
+
+    //reinitialize sub_symbols because new subroutine is being compiled
+    freeSymbolTable(sub_symbols, number_of_sub_symbols);
+    sub_symbols = initialize_symbol_table(length_of_sub_symbols, number_of_sub_symbols);
+    
+    writeSourcePosition(inputFile, outputFile);
+    fgets_nl(line, sizeof(line), inputFile);
+    TokenType lineType = tokenType(line);
+    if (lineType != TokenTypeIdentifier && strcmp(line, "int") && strcmp(line, "char") && strcmp(line, "boolean") && strcmp(line, "void")) {
+        compileError("Class subroutine declaration does not have a valid return type!\n");
+    }
+    char returnType[256];
+    strcpy(returnType, line);
+    
+    fgets_nl(line, sizeof(line), inputFile);
+    if (tokenType(line) == TokenTypeIdentifier) {
+        fprintf(outputFile, "function %s.%s ", currentClass, line);
+        
+        free(currentSubroutine);
+        currentSubroutine = malloc(strlen(line) + 1);
+        strcpy(currentSubroutine, line);
+        labelNumber = 0;
+        branchNumber = 0;
+    } else {
+        compileError("Class subroutine name must have a valid name!\n");
+    }
+    
+    fgets_nl(line, sizeof(line), inputFile);
+    if (strcmp(line, "(")) {
+        compileError("Class subroutine missing '('!\n");
+    }
+    
+    if (!strcmp(subType, "method")) {
+        Symbol *newSymbol = calloc(1, sizeof(Symbol));
+        
+        newSymbol->name = malloc(strlen("this") + 1);
+        strcpy(newSymbol->name, "this");
+        
+        newSymbol->type = malloc(strlen(currentClass) + 1);
+        strcpy(newSymbol->type, currentClass);
+        
+        newSymbol->kind = malloc(strlen("argument") + 1);
+        strcpy(newSymbol->kind, "argument");
+        
+        sub_symbols = add_symbol(sub_symbols, newSymbol);
+    }
+    
+    compileParameterList(inputFile, outputFile);
+    
+    fgets_nl(line, sizeof(line), inputFile);
+    if (strcmp(line, ")")) {
+        compileError("Class subroutine missing ')' at end of parameter list!\n");
+    }
+    
+    addSubroutineDeclaration(currentSubroutine, subType, returnType);
+    
+    compileSubroutineBody(inputFile, outputFile, subType);
+}
+
+void releaseConsumedTokens(FILE *inputFile);
+
+void compileClass(FILE *inputFile, FILE *outputFile) {
+    char line[256];
+    
+    class_symbols = initialize_symbol_table(length_of_class_symbols, number_of_class_symbols);
+    
+    fgets_nl(line, sizeof(line), inputFile);
+    if (strcmp(line, "class")) {
+        compileError("File does not begin with a class declaration!\n");
+    }
+    
+    fgets_nl(line, sizeof(line), inputFile);
+    currentClass = malloc(strlen(line) + 1);
+    if (tokenType(line) == TokenTypeIdentifier) {
+        strcpy(currentClass, line);
+    } else {
+        compileError("Class declaration has no class name!\n");
+    }
+    
+    //the interface is written next to the source and looked up by class name, so the two names have to agree
+    if (options.useInterfaces) {
+        const char *separator = strrchr(currentInputPath, '/');
+        const char *fileName = separator ? separator + 1 : currentInputPath;
+        size_t length = strlen(currentClass);
+        if (strncmp(fileName, currentClass, length) || strcmp(fileName + length, ".jack")) {
+            compileError("Class '%s' must be declared in '%s.jack' for its interface to be found!\n", currentClass, currentClass);
+        }
+    }
+    
+    fgets_nl(line, sizeof(line), inputFile);
+    if (strcmp(line, "{")) {
+        compileError("Class declaration is missing '{'!\n");
+    }
+    
+    while (fgets_nl(line, sizeof(line), inputFile)) {
+        if (!strcmp(line, "field") || !strcmp(line, "static")) {
+            compileClassVarDeclaration(line, inputFile, outputFile);
+        } else if (!strcmp(line, "constructor") || !strcmp(line, "function") || !strcmp(line, "method")) {
+            size_t size = 0;
+            subroutineFile = open_memstream(&subroutineBuffer, &size);
+            compileSubroutineDeclaration(line, inputFile, subroutineFile);
+            fclose(subroutineFile);
+            subroutineFile = NULL;
+            class_subroutines[number_of_class_subroutines - 1].isPure = isPureBuffer(subroutineBuffer);
+            
+            if (options.optimize && options.profilePath) {
+                keepSubroutine(subroutineBuffer);
+            } else {
+                writeSubroutine(outputFile, subroutineBuffer);
+                free(subroutineBuffer);
+                fputc('\n', outputFile);
+            }
+            subroutineBuffer = NULL;
+            
+            //nothing of the subroutine is needed any more
+            freeSymbolTable(sub_symbols, number_of_sub_symbols);
+            sub_symbols = NULL;
+            *number_of_sub_symbols = 0;
+            invalidateThatPointer();
+            releaseConsumedTokens(inputFile);
+        } else if (!strcmp(line, "}")) {
+            //do nothing
+        } else {
+            compileError("Unrecognized keyword specified in class!\n");
+        }
+    }
+    
+    if (options.optimize && options.profilePath) {
+        writeProfiledClass(outputFile);
+    }
+}
+
+#pragma mark Tokenizer
+
+//the classes are ordered so that every class making up a word (identifier, keyword or integer) is at most CharacterDigit
+typedef enum {
+    CharacterIdentifier,
+    CharacterDigit,
+    CharacterWhitespace, //the space and every control character
+    CharacterSymbol,
+    CharacterQuote
+} CharacterClass;
+
+unsigned char characterClasses[256];
+
+//the building blocks of the tokenizer, each returning the first position at or after position where its run ends, or length
+typedef struct Scanner {
+    size_t (*skipWhitespace)(const char *source, size_t position, size_t length);
+    size_t (*skipWord)(const char *source, size_t position, size_t length);
+    size_t (*findLineEnd)(const char *source, size_t position, size_t length);
+    size_t (*findStringEnd)(const char *source, size_t position, size_t length);
+    size_t (*findCommentEnd)(const char *source, size_t position, size_t length); //position of the '*' of "*/"
+    size_t (*countNewlines)(const char *source, size_t position, size_t end);
+} Scanner;
+
+void initializeCharacterClasses() {
+    if (characterClasses[' '] == CharacterWhitespace) { return; }
+    
+    for (int c = 0; c <= ' '; c++) {
+        characterClasses[c] = CharacterWhitespace;
+    }
+    for (const char *symbol = "{}()[].,;+-*/&|<>=~"; *symbol; symbol++) {
+        characterClasses[(unsigned char)*symbol] = CharacterSymbol;
+    }
+    for (int c = '0'; c <= '9'; c++) {
+        characterClasses[c] = CharacterDigit;
+    }
+    characterClasses['"'] = CharacterQuote;
+}
+
+size_t scalarSkipWhitespace(const char *source, size_t position, size_t length) {
+    while (position < length && characterClasses[(unsigned char)source[position]] == CharacterWhitespace) {
+        position++;
+    }
+    return position;
+}
+
+size_t scalarSkipWord(const char *source, size_t position, size_t length) {
+    while (position < length && characterClasses[(unsigned char)source[position]] <= CharacterDigit) {
+        position++;
+    }
+    return position;
+}
+
+size_t scalarFindLineEnd(const char *source, size_t position, size_t length) {
+    while (position < length && source[position] != '\n') {
+        position++;
+    }
+    return position;
+}
+
+size_t scalarFindStringEnd(const char *source, size_t position, size_t length) {
+    while (position < length && source[position] != '"' && source[position] != '\n') {
+        position++;
+    }
+    return position;
+}
+
+size_t scalarFindCommentEnd(const char *source, size_t position, size_t length) {
+    while (position + 1 < length && !(source[position] == '*' && source[position + 1] == '/')) {
+        position++;
+    }
+    return position + 1 < length ? position : length;
+}
+
+size_t scalarCountNewlines(const char *source, size_t position, size_t end) {
+    size_t count = 0;
+    for (; position < end; position++) {
+        count += source[position] == '\n';
+    }
+    return count;
+}
+
+const Scanner scalarScanner = {
+    scalarSkipWhitespace,
+    scalarSkipWord,
+    scalarFindLineEnd,
+    scalarFindStringEnd,
+    scalarFindCommentEnd,
+    scalarCountNewlines
+};
+
+#ifdef JACK_VECTOR_LEXER
+//The vector scanners classify 16 (SSE2) or 32 (AVX2) bytes per step into a bit mask and hand the tail to the scalar ones.
+//A byte is whitespace when it is at most ' ', and the symbols and the quote fall into a few runs of ASCII:
+//'"', '&', '(' to '/', ';' to '>', '[', ']' and '{' to '~'.
+
+__m128i sse2IsInRange(__m128i bytes, char first, char last) {
+    __m128i offset = _mm_sub_epi8(bytes, _mm_set1_epi8(first));
+    return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(last - first)), offset);
+}
+
+__m128i sse2IsWordEnd(__m128i bytes) {
+    __m128i space = _mm_set1_epi8(' ');
+    __m128i ends = _mm_cmpeq_epi8(_mm_max_epu8(bytes, space), space);
+    ends = _mm_or_si128(ends, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')));
+    ends = _mm_or_si128(ends, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('&')));
+    ends = _mm_or_si128(ends, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('[')));
+    ends = _mm_or_si128(ends, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(']')));
+    ends = _mm_or_si128(ends, sse2IsInRange(bytes, '(', '/'));
+    ends = _mm_or_si128(ends, sse2IsInRange(bytes, ';', '>'));
+    return _mm_or_si128(ends, sse2IsInRange(bytes, '{', '~'));
+}
+
+size_t sse2SkipWhitespace(const char *source, size_t position, size_t length) {
+    __m128i space = _mm_set1_epi8(' ');
+    for (; position + 16 <= length; position += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(source + position));
+        unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(bytes, space), space)) & 0xFFFF;
+        if (mask) { return position + __builtin_ctz(mask); }
+    }
+    return scalarSkipWhitespace(source, position, length);
+}
+
+size_t sse2SkipWord(const char *source, size_t position, size_t length) {
+    for (; position + 16 <= length; position += 16) {
+        unsigned mask = _mm_movemask_epi8(sse2IsWordEnd(_mm_loadu_si128((const __m128i *)(source + position))));
+        if (mask) { return position + __builtin_ctz(mask); }
+    }
+    return scalarSkipWord(source, position, length);
+}
+
+size_t sse2FindLineEnd(const char *source, size_t position, size_t length) {
+    __m128i newline = _mm_set1_epi8('\n');
+    for (; position + 16 <= length; position += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(source + position));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+        if (mask) { return position + __builtin_ctz(mask); }
+    }
+    return scalarFindLineEnd(source, position, length);
+}
+
+size_t sse2FindStringEnd(const char *source, size_t position, size_t length) {
+    __m128i newline = _mm_set1_epi8('\n');
+    __m128i quote = _mm_set1_epi8('"');
+    for (; position + 16 <= length; position += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(source + position));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, newline), _mm_cmpeq_epi8(bytes, quote)));
+        if (mask) { return position + __builtin_ctz(mask); }
+    }
+    return scalarFindStringEnd(source, position, length);
+}
+
+size_t sse2FindCommentEnd(const char *source, size_t position, size_t length) {
+    __m128i star = _mm_set1_epi8('*');
+    __m128i slash = _mm_set1_epi8('/');
+    for (; position + 17 <= length; position += 16) {
+        __m128i stars = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(source + position)), star);
+        __m128i slashes = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(source + position + 1)), slash);
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(stars, slashes));
+        if (mask) { return position + __builtin_ctz(mask); }
+    }
+    return scalarFindCommentEnd(source, position, length);
+}
+
+size_t sse2CountNewlines(const char *source, size_t position, size_t end) {
+    __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    for (; position + 16 <= end; position += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(source + position));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)));
+    }
+    return count + scalarCountNewlines(source, position, end);
+}
+
+const Scanner sse2Scanner = {
+    sse2SkipWhitespace,
+    sse2SkipWord,
+    sse2FindLineEnd,
+    sse2FindStringEnd,
+    sse2FindCommentEnd,
+    sse2CountNewlines
+};
+
+__attribute__((target("avx2"))) __m256i avx2IsInRange(__m256i bytes, char first, char last) {
+    __m256i offset = _mm256_sub_epi8(bytes, _mm256_set1_epi8(first));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(last - first)), offset);
+}
+
+__attribute__((target("avx2"))) __m256i avx2IsWordEnd(__m256i bytes) {
+    __m256i space = _mm256_set1_epi8(' ');
+    __m256i ends = _mm256_cmpeq_epi8(_mm256_max_epu8(bytes, space), space);
+    ends = _mm256_or_si256(ends, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('"')));
+    ends = _mm256_or_si256(ends, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('&')));
+    ends = _mm256_or_si256(ends, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('[')));
+    ends = _mm256_or_si256(ends, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(']')));
+    ends = _mm256_or_si256(ends, avx2IsInRange(bytes, '(', '/'));
+    ends = _mm256_or_si256(ends, avx2IsInRange(bytes, ';', '>'));
+    return _mm256_or_si256(ends, avx2IsInRange(bytes, '{', '~'));
+}
+
+__attribute__((target("avx2"))) size_t avx2SkipWhitespace(const char *source, size_t position, size_t length) {
+    __m256i space = _mm256_set1_epi8(' ');
+    for (; position + 32 <= length; position += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(source + position));
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(bytes, space), space));
+        if (mask) { return position + __builtin_ctz(mask); }
+    }
+    return sse2SkipWhitespace(source, position, length);
+}
 
-                fgets_nl(line, sizeof(line), inputFile);
-                int offset = 0;
-                if (!strcmp(line, "[")) {
-                    offset = 1;
-                    writeSymbol(outputFile, "push", symbol);
-                    
-                    compileExpression(inputFile, outputFile);
-                    
-                    fputs("add\n", outputFile);
-                    
-                    fgets_nl(line, sizeof(line), inputFile);
-                    if (strcmp(line, "]")) {
-                        printf("Expected ']' to end expression!\n");
-                        exit(1);
-                    }
-                    
-                    fgets_nl(line, sizeof(line), inputFile);
-                }
-                
-                if (strcmp(line, "=")) {
-                    printf("Expected '=' after let statement declaration!\n");
-                    exit(1);
-                }
-                
-                compileExpression(inputFile, outputFile);
-                if (offset) {
-                    fputs("pop temp 0\npop pointer 1\npush temp 0\npop that 0\n", outputFile);
-                } else {
-                    writeSymbol(outputFile, "pop", symbol);
-                }
-                
-                fgets_nl(line, sizeof(line), inputFile);
-                if (strcmp(line, ";")) {
-                    printf("Expected ';' at end of 'let' statement, not '%s'!\n", line);
-                    exit(1);
-                }
-            } else if (!strcmp(line, "if")) {
-                fgets_nl(line, sizeof(line), inputFile);
-                if (strcmp(line, "(")) {
-                    printf("Expected '(' at beginning of %s expression!\n", statementType);
-                    exit(1);
-                }
-                
-                compileExpression(inputFile, outputFile);
-                
-                fgets_nl(line, sizeof(line), inputFile);
-                if (strcmp(line, ")")) {
-                    printf("Expected ')' at end of %s expression!\n", statementType);
-                    exit(1);
-                }
-                
-                fputs("not\n", outputFile);
-                
-                char label_1[9];
-                uniqueLabel(label_1);
-                fprintf(outputFile, "if-goto %s\n", label_1);
-                
-                fgets_nl(line, sizeof(line), inputFile);
-                if (strcmp(line, "{")) {
-                    printf("Expected '{' at beginning of %s statement!\n", statementType);
-                    exit(1);
-                }
-                
-                compileStatements(inputFile, outputFile);
-                
-                fgets_nl(line, sizeof(line), inputFile);
-                if (strcmp(line, "}")) {
-                    printf("Expected '}' at end of %s statement!\n", statementType);
-                    exit(1);
-                }
-                
-                char label_2[9];
-                uniqueLabel(label_2);
-                fprintf(outputFile, "goto %s\n", label_2);
-                fprintf(outputFile, "label %s\n", label_1);
-                
-                fpos_t pos;
-                fgetpos(inputFile, &pos);
-                
-                fgets_nl(line, sizeof(line), inputFile);
-                if (!strcmp(line, "else")) {
-                    fgets_nl(line, sizeof(line), inputFile);
-                    if (strcmp(line, "{")) {
-                        printf("Expected '{' at beginning of 'else' statement!\n");
-                        exit(1);
-                    }
-                    
-                    compileStatements(inputFile, outputFile);
-                    
-                    fgets_nl(line, sizeof(line), inputFile);
-                    if (strcmp(line, "}")) {
-                        printf("Expected '}' at end of 'else' statement!\n");
-                        exit(1);
-                    }
-                } else {
-                    fsetpos(inputFile, &pos);
-                }
-                
-                fprintf(outputFile, "label %s\n", label_2);
-            } else if (!strcmp(line, "while")) {
-                char label_1[9];
-                uniqueLabel(label_1);
-                fprintf(outputFile, "label %s\n", label_1);
-                
-                fgets_nl(line, sizeof(line), inputFile);
-                if (strcmp(line, "(")) {
-                    printf("Expected '(' at beginning of %s expression!\n", statementType);
-                    exit(1);
-                }
-                
-                compileExpression(inputFile, outputFile);
-                
-                fgets_nl(line, sizeof(line), inputFile);
-                if (strcmp(line, ")")) {
-                    printf("Expected ')' at end of %s expression!\n", statementType);
-                    exit(1);
-                }
-                
-                fputs("not\n", outputFile);
-                
-                char label_2[9];
-                uniqueLabel(label_2);
-                fprintf(outputFile, "if-goto %s\n", label_2);
-                
-                fgets_nl(line, sizeof(line), inputFile);
-                if (strcmp(line, "{")) {
-                    printf("Expected '{' at beginning of %s statement!\n", statementType);
-                    exit(1);
-                }
-                
-                compileStatements(inputFile, outputFile);
-                
-                fgets_nl(line, sizeof(line), inputFile);
-                if (strcmp(line, "}")) {
-                    printf("Expected '}' at end of %s statement!\n", statementType);
-                    exit(1);
-                }
-                
-                fprintf(outputFile, "goto %s\n", label_1);
-                fprintf(outputFile, "label %s\n", label_2);
-            } else if (!strcmp(line, "do")) {
-                compileSubroutineCall(inputFile, outputFile, 0);
-                
-                fgets_nl(line, sizeof(line), inputFile);
-                if (strcmp(line, ";")) {
-                    printf("Expected ';' at end of 'do' statement!\n");
-                    exit(1);
-                }
-            } else if (!strcmp(line, "return")) {
-                fpos_t pos;
-                fgetpos(inputFile, &pos);
-                
-                fgets_nl(line, sizeof(line), inputFile);
-                if (strcmp(line, ";") != 0) {
-                    fsetpos(inputFile, &pos);
-                    compileExpression(inputFile, outputFile);
-                    
-                    fgets_nl(line, sizeof(line), inputFile);
+__attribute__((target("avx2"))) size_t avx2SkipWord(const char *source, size_t position, size_t length) {
+    for (; position + 32 <= length; position += 32) {
+        unsigned mask = _mm256_movemask_epi8(avx2IsWordEnd(_mm256_loadu_si256((const __m256i *)(source + position))));
+        if (mask) { return position + __builtin_ctz(mask); }
+    }
+    return sse2SkipWord(source, position, length);
+}
+
+__attribute__((target("avx2"))) size_t avx2FindLineEnd(const char *source, size_t position, size_t length) {
+    __m256i newline = _mm256_set1_epi8('\n');
+    for (; position + 32 <= length; position += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(source + position));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, newline));
+        if (mask) { return position + __builtin_ctz(mask); }
+    }
+    return sse2FindLineEnd(source, position, length);
+}
+
+__attribute__((target("avx2"))) size_t avx2FindStringEnd(const char *source, size_t position, size_t length) {
+    __m256i newline = _mm256_set1_epi8('\n');
+    __m256i quote = _mm256_set1_epi8('"');
+    for (; position + 32 <= length; position += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(source + position));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, newline), _mm256_cmpeq_epi8(bytes, quote)));
+        if (mask) { return position + __builtin_ctz(mask); }
+    }
+    return sse2FindStringEnd(source, position, length);
+}
+
+__attribute__((target("avx2"))) size_t avx2FindCommentEnd(const char *source, size_t position, size_t length) {
+    __m256i star = _mm256_set1_epi8('*');
+    __m256i slash = _mm256_set1_epi8('/');
+    for (; position + 33 <= length; position += 32) {
+        __m256i stars = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(source + position)), star);
+        __m256i slashes = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(source + position + 1)), slash);
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(stars, slashes));
+        if (mask) { return position + __builtin_ctz(mask); }
+    }
+    return sse2FindCommentEnd(source, position, length);
+}
+
+__attribute__((target("avx2"))) size_t avx2CountNewlines(const char *source, size_t position, size_t end) {
+    __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    for (; position + 32 <= end; position += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(source + position));
+        count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, newline)));
+    }
+    return count + sse2CountNewlines(source, position, end);
+}
+
+const Scanner avx2Scanner = {
+    avx2SkipWhitespace,
+    avx2SkipWord,
+    avx2FindLineEnd,
+    avx2FindStringEnd,
+    avx2FindCommentEnd,
+    avx2CountNewlines
+};
+#endif
+
+//the fastest scanner the processor supports, the scalar one when built without vector support or with -DJACK_SCALAR_LEXER
+const Scanner *vectorScanner() {
+#ifdef JACK_VECTOR_LEXER
+    return __builtin_cpu_supports("avx2") ? &avx2Scanner : &sse2Scanner;
+#else
+    return &scalarScanner;
+#endif
+}
+
+//the token stream is built in memory and written in one go, since most tokens are a few bytes long
+typedef struct TokenBuffer {
+    char *bytes;
+    size_t length;
+    size_t size;
+    size_t offset; //stream offset of bytes[0], past zero once lazily tokenized tokens are released
+} TokenBuffer;
+
+void appendTokenBytes(TokenBuffer *buffer, const char *bytes, size_t length) {
+    if (buffer->length + length > buffer->size) {
+        buffer->size = (buffer->size + length) * 2;
+        buffer->bytes = realloc(buffer->bytes, buffer->size);
+    }
+    memcpy(buffer->bytes + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+//how far a source has been tokenized, so tokenizing can stop and resume between tokens
+typedef struct Lexer {
+    const char *source;
+    size_t length;
+    size_t position;
+    int line;
+    size_t lineStart;
+    const Scanner *scanner;
+    int recordPositions;
+} Lexer;
+
+//keeps line and lineStart up to date over a skipped run of whitespace or a comment body
+void skipLines(const Scanner *scanner, const char *source, size_t position, size_t end, int *line, size_t *lineStart) {
+    size_t newlines = scanner->countNewlines(source, position, end);
+    if (!newlines) { return; }
+    
+    *line += (int)newlines;
+    while (source[end - 1] != '\n') {
+        end--;
+    }
+    *lineStart = end;
+}
+
+//appends tokens to tokens, one per line, with '<', '>' and '&' escaped and string constants kept in their quotes,
+//until it holds minimumLength bytes or the source ends.
+//With recordPositions every token's stream offset and source position is added to token_positions.
+LexicalError lexTokens(Lexer *lexer, TokenBuffer *tokens, size_t minimumLength) {
+    const char *source = lexer->source;
+    size_t length = lexer->length;
+    const Scanner *scanner = lexer->scanner;
+    int line = lexer->line;
+    size_t lineStart = lexer->lineStart;
+    size_t position = lexer->position;
+    
+    LexicalError error = {NULL, 0, 0};
+    while (tokens->length < minimumLength) {
+        size_t end = scanner->skipWhitespace(source, position, length);
+        skipLines(scanner, source, position, end, &line, &lineStart);
+        position = end;
+        if (position >= length) { break; }
+        
+        char c = source[position];
+        char next = position + 1 < length ? source[position + 1] : 0;
+        
+        if (c == '/' && next == '/') {
+            position = scanner->findLineEnd(source, position + 2, length);
+            continue;
+        } else if (c == '/' && next == '*') {
+            //the whole body is skipped in one scan, whatever lines it spans
+            end = scanner->findCommentEnd(source, position + 2, length);
+            if (end >= length) {
+                error = (LexicalError){"Unterminated comment!", line, (int)(position - lineStart + 1)};
+                break;
+            }
+            skipLines(scanner, source, position + 2, end, &line, &lineStart);
+            position = end + 2;
+            continue;
+        }
+        
+        if (lexer->recordPositions) {
+            if (number_of_token_positions == length_of_token_positions) {
+                length_of_token_positions = length_of_token_positions ? length_of_token_positions * 2 : 1024;
+                token_positions = realloc(token_positions, length_of_token_positions * sizeof(TokenPosition));
+            }
+            token_positions[number_of_token_positions++] = (TokenPosition){tokens->offset + tokens->length, line, (int)(position - lineStart + 1)};
+        }
+        
+        switch (characterClasses[(unsigned char)c]) {
+            case CharacterSymbol:
+                if (c == '<') {
+                    appendTokenBytes(tokens, "&lt;", 4);
+                } else if (c == '>') {
+                    appendTokenBytes(tokens, "&gt;", 4);
+                } else if (c == '&') {
+                    appendTokenBytes(tokens, "&amp;", 5);
                 } else {
-                    fputs("push constant 0\n", outputFile);
+                    appendTokenBytes(tokens, &c, 1);
                 }
-                
-                if (strcmp(line, ";")) {
-                    printf("Expected ';' at end of 'return' statement!\n");
-                    exit(1);
+                position++;
+                break;
+            case CharacterQuote:
+                end = scanner->findStringEnd(source, position + 1, length);
+                if (end >= length || source[end] != '"') {
+                    error = (LexicalError){"Unterminated string constant!", line, (int)(position - lineStart + 1)};
+                    break;
                 }
-                
-                fputs("return\n", outputFile);
+                appendTokenBytes(tokens, source + position, end + 1 - position);
+                position = end + 1;
+                break;
+            default:
+                end = scanner->skipWord(source, position + 1, length);
+                appendTokenBytes(tokens, source + position, end - position);
+                position = end;
+                break;
+        }
+        if (error.message) { break; }
+        appendTokenBytes(tokens, "\n", 1);
+    }
+    
+    //nothing more is tokenized after an error
+    lexer->position = error.message ? length : position;
+    lexer->line = line;
+    lexer->lineStart = lineStart;
+    return error;
+}
+
+//writes all the tokens of source to tokenFile
+LexicalError tokenizeSource(const char *source, size_t length, FILE *tokenFile, const Scanner *scanner, int recordPositions) {
+    initializeCharacterClasses();
+    
+    Lexer lexer = {source, length, 0, 1, 0, scanner, recordPositions};
+    TokenBuffer tokens = {NULL, 0, 0, 0};
+    LexicalError error = lexTokens(&lexer, &tokens, SIZE_MAX);
+    
+    if (tokens.length) {
+        fwrite(tokens.bytes, 1, tokens.length, tokenFile);
+    }
+    free(tokens.bytes);
+    
+    return error;
+}
+
+//finds where the token ending before offset in the token stream starts in the source, by lexing the source again up to it,
+//so that an error can point into the source without positions being kept for every token. Returns 0 before the first token.
+int findTokenPosition(size_t offset, int *line, int *column) {
+    if (!currentSource || !offset) { return 0; }
+    initializeCharacterClasses();
+    
+    //positions recorded for the source map are set aside, the lexer appends to token_positions
+    TokenPosition *sourceMapPositions = token_positions;
+    size_t number_of_source_map_positions = number_of_token_positions;
+    size_t length_of_source_map_positions = length_of_token_positions;
+    token_positions = NULL;
+    number_of_token_positions = 0;
+    length_of_token_positions = 0;
+    
+    Lexer lexer = {currentSource, currentSourceLength, 0, 1, 0, vectorScanner(), 1};
+    TokenBuffer tokens = {NULL, 0, 0, 0};
+    int isFound = 0;
+    while (tokens.offset < offset && lexer.position < lexer.length) {
+        size_t previousPosition = lexer.position;
+        LexicalError error = lexTokens(&lexer, &tokens, 65536);
+        tokens.offset += tokens.length;
+        tokens.length = 0;
+        if (error.message || lexer.position == previousPosition) { break; }
+    }
+    
+    for (size_t i = number_of_token_positions; i > 0; i--) {
+        if (token_positions[i - 1].offset < offset) {
+            *line = token_positions[i - 1].line;
+            *column = token_positions[i - 1].column;
+            isFound = 1;
+            break;
+        }
+    }
+    
+    free(tokens.bytes);
+    free(token_positions);
+    token_positions = sourceMapPositions;
+    number_of_token_positions = number_of_source_map_positions;
+    length_of_token_positions = length_of_source_map_positions;
+    return isFound;
+}
+
+//tokenizes source with both the scalar and the vector scanner and fails unless they agree byte for byte
+LexicalError verifyTokenizer(const char *source, size_t length, FILE *tokenFile) {
+    char *scalarTokens = NULL;
+    char *vectorTokens = NULL;
+    size_t scalarSize = 0;
+    size_t vectorSize = 0;
+    
+    FILE *scalarFile = open_memstream(&scalarTokens, &scalarSize);
+    LexicalError scalarError = tokenizeSource(source, length, scalarFile, &scalarScanner, options.writeSourceMaps);
+    fclose(scalarFile);
+    
+    FILE *vectorFile = open_memstream(&vectorTokens, &vectorSize);
+    LexicalError vectorError = tokenizeSource(source, length, vectorFile, vectorScanner(), 0);
+    fclose(vectorFile);
+    
+    size_t position = 0;
+    while (position < scalarSize && position < vectorSize && scalarTokens[position] == vectorTokens[position]) {
+        position++;
+    }
+    int isMatching = position == scalarSize && position == vectorSize && scalarError.message == vectorError.message &&
+        scalarError.line == vectorError.line && scalarError.column == vectorError.column;
+    
+    fwrite(scalarTokens, 1, scalarSize, tokenFile);
+    free(scalarTokens);
+    free(vectorTokens);
+    
+    if (!isMatching) {
+#ifdef JACK_FUZZ
+        abort();
+#endif
+        compileError("Vector tokenizer output differs from the scalar tokenizer at byte %zu!\n", position);
+    }
+    
+    return scalarError;
+}
+
+//tokens made while the parser reads them, for --bounded-memory. Only the tokens of the subroutine
+//being compiled are kept, since the parser never backtracks to the one before.
+typedef struct LazyTokens {
+    FILE *file;
+    char fileBuffer[4096];
+    Lexer lexer;
+    TokenBuffer tokens;
+    size_t position; //stream offset the next read starts at
+    size_t releasedSource; //source bytes whose pages have been dropped
+} LazyTokens;
+
+LazyTokens *lazyTokens;
+
+ssize_t readLazyTokens(LazyTokens *lazy, char *buffer, size_t size) {
+    TokenBuffer *tokens = &lazy->tokens;
+    size_t end = lazy->position + size;
+    if (end > tokens->offset + tokens->length && lazy->lexer.position < lazy->lexer.length) {
+        LexicalError error = lexTokens(&lazy->lexer, tokens, end - tokens->offset);
+        if (error.message) {
+            pendingLexicalError = error;
+        }
+    }
+    
+    size_t available = tokens->offset + tokens->length - lazy->position;
+    if (size > available) {
+        size = available;
+    }
+    memcpy(buffer, tokens->bytes + (lazy->position - tokens->offset), size);
+    lazy->position += size;
+    return size;
+}
+
+//returns the new position, or -1 when it lies outside the tokens kept
+off_t seekLazyTokens(LazyTokens *lazy, off_t offset, int whence) {
+    off_t position;
+    if (whence == SEEK_SET) {
+        position = offset;
+    } else if (whence == SEEK_CUR) {
+        position = lazy->position + offset;
+    } else {
+        return -1;
+    }
+    
+    if (position < (off_t)lazy->tokens.offset || position > (off_t)(lazy->tokens.offset + lazy->tokens.length)) { return -1; }
+    lazy->position = position;
+    return position;
+}
+
+#ifdef __APPLE__
+int readLazyTokensCookie(void *cookie, char *buffer, int size) {
+    return (int)readLazyTokens(cookie, buffer, size);
+}
+
+fpos_t seekLazyTokensCookie(void *cookie, fpos_t offset, int whence) {
+    return seekLazyTokens(cookie, offset, whence);
+}
+#else
+ssize_t readLazyTokensCookie(void *cookie, char *buffer, size_t size) {
+    return readLazyTokens(cookie, buffer, size);
+}
+
+int seekLazyTokensCookie(void *cookie, off64_t *offset, int whence) {
+    off_t position = seekLazyTokens(cookie, *offset, whence);
+    if (position < 0) { return -1; }
+    *offset = position;
+    return 0;
+}
+#endif
+
+//opens a stream reading the tokens of source, tokenizing as far as the reads go
+FILE *openLazyTokens(const char *source, size_t length) {
+    initializeCharacterClasses();
+    
+    lazyTokens = calloc(1, sizeof(LazyTokens));
+    lazyTokens->lexer = (Lexer){source, length, 0, 1, 0, vectorScanner(), options.writeSourceMaps};
+#ifdef __APPLE__
+    lazyTokens->file = funopen(lazyTokens, readLazyTokensCookie, NULL, seekLazyTokensCookie, NULL);
+#else
+    cookie_io_functions_t functions = {readLazyTokensCookie, NULL, seekLazyTokensCookie, NULL};
+    lazyTokens->file = fopencookie(lazyTokens, "r", functions);
+#endif
+    setvbuf(lazyTokens->file, lazyTokens->fileBuffer, _IOFBF, sizeof(lazyTokens->fileBuffer));
+    return lazyTokens->file;
+}
+
+//forgets the tokens the parser has read past and the source pages they were made from
+void releaseConsumedTokens(FILE *inputFile) {
+    if (!lazyTokens) { return; }
+    
+    //stdio seeks back to the start of a buffer-sized block and reads forward when the parser backtracks
+    TokenBuffer *tokens = &lazyTokens->tokens;
+    long offset = ftell(inputFile) / sizeof(lazyTokens->fileBuffer) * sizeof(lazyTokens->fileBuffer);
+    if (offset <= (long)tokens->offset) { return; }
+    
+    size_t consumed = offset - tokens->offset;
+    memmove(tokens->bytes, tokens->bytes + consumed, tokens->length - consumed);
+    tokens->length -= consumed;
+    tokens->offset = offset;
+    
+    //one long subroutine should not keep its tokens' memory for the rest of the class
+    if (tokens->size > tokens->length * 4 + 65536) {
+        tokens->size = tokens->length * 2 + 4096;
+        tokens->bytes = realloc(tokens->bytes, tokens->size);
+    }
+    
+    size_t firstKept = 0;
+    while (firstKept < number_of_token_positions && token_positions[firstKept].offset < tokens->offset) {
+        firstKept++;
+    }
+    if (firstKept) {
+        number_of_token_positions -= firstKept;
+        memmove(token_positions, token_positions + firstKept, number_of_token_positions * sizeof(TokenPosition));
+    }
+    
+    //the lexer only reads forward, and a dropped page of the mapped source is read again from the file if it ever were needed
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t tokenizedSource = lazyTokens->lexer.position / pageSize * pageSize;
+    if (tokenizedSource > lazyTokens->releasedSource) {
+        madvise((char *)lazyTokens->lexer.source + lazyTokens->releasedSource, tokenizedSource - lazyTokens->releasedSource, MADV_DONTNEED);
+        lazyTokens->releasedSource = tokenizedSource;
+    }
+}
+
+//closes the stream too, since closing may still seek in it
+void freeLazyTokens() {
+    if (lazyTokens) {
+        fclose(lazyTokens->file);
+        free(lazyTokens->tokens.bytes);
+        free(lazyTokens);
+        lazyTokens = NULL;
+    }
+    pendingLexicalError = (LexicalError){NULL, 0, 0};
+}
+
+#pragma mark Compiling Files
+
+//compiles source, whose tokens are written to helperFile first unless it streams them lazily
+void compileSource(const char *source, size_t length, FILE *helperFile, FILE *outputFile) {
+    //tokenizer
+    if (!lazyTokens) {
+        LexicalError error;
+        if (options.verifyTokenizer) {
+            error = verifyTokenizer(source, length, helperFile);
+        } else {
+            error = tokenizeSource(source, length, helperFile, vectorScanner(), options.writeSourceMaps);
+        }
+        if (error.message) {
+            compileError("%s:%d:%d: %s\n", currentInputPath, error.line, error.column, error.message);
+        }
+    }
+    
+    //initialize symbol table counts
+    length_of_class_symbols = malloc(sizeof(size_t));
+    length_of_sub_symbols = malloc(sizeof(size_t));
+    number_of_class_symbols = malloc(sizeof(size_t));
+    number_of_sub_symbols = malloc(sizeof(size_t));
+    
+    *length_of_class_symbols = 0;
+    *length_of_sub_symbols = 0;
+    *number_of_class_symbols = 0;
+    *number_of_sub_symbols = 0;
+    
+    //parse
+    rewind(helperFile);
+    currentTokenFile = helperFile;
+    currentSource = source;
+    currentSourceLength = length;
+    compileClass(helperFile, outputFile);
+}
+
+//frees everything compiling one class leaves behind, including after a compile error unwound to errorJump
+void resetCompilerState() {
+    if (subroutineFile) {
+        fclose(subroutineFile);
+        subroutineFile = NULL;
+    }
+    free(subroutineBuffer);
+    subroutineBuffer = NULL;
+    freeClassBodies();
+    freeBranchBuffers();
+    
+    if (number_of_class_symbols) {
+        freeSymbolTable(class_symbols, number_of_class_symbols);
+    }
+    class_symbols = NULL;
+    
+    if (number_of_sub_symbols) {
+        freeSymbolTable(sub_symbols, number_of_sub_symbols);
+    }
+    sub_symbols = NULL;
+    
+    free(length_of_class_symbols);
+    free(length_of_sub_symbols);
+    free(number_of_class_symbols);
+    free(number_of_sub_symbols);
+    length_of_class_symbols = NULL;
+    length_of_sub_symbols = NULL;
+    number_of_class_symbols = NULL;
+    number_of_sub_symbols = NULL;
+    
+    free(currentClass);
+    currentClass = NULL;
+    
+    free(currentSubroutine);
+    currentSubroutine = NULL;
+    
+    freeClassSubroutines();
+    currentInputPath = NULL;
+    currentTokenFile = NULL;
+    currentSource = NULL;
+    currentSourceLength = 0;
+    
+    invalidateThatPointer();
+    termDepth = 0;
+    freeExpressionNodes();
+    free(expression_nodes);
+    expression_nodes = NULL;
+    length_of_expression_nodes = 0;
+    
+    free(token_positions);
+    token_positions = NULL;
+    number_of_token_positions = 0;
+    length_of_token_positions = 0;
+    freeLazyTokens();
+    sourceMapLine = 0;
+    sourceMapColumn = 0;
+}
+
+//what compiling a file produced, for a server that keeps it
+typedef struct CompiledFile {
+    char *output;
+    size_t output_length;
+    char *interface;
+    size_t interface_length;
+} CompiledFile;
+
+//compiles the jack file at inputPath into the .vm file next to it, and into compiled as well unless that is NULL
+void compileFile(char *inputPath, CompiledFile *compiled) {
+    //read or map the whole input file, so the tokenizer can scan it in vector-sized steps
+    currentInputPath = inputPath;
+    size_t length = 0;
+    char *source = options.boundMemory ? mapWholeFile(inputPath, &length) : readWholeFile(inputPath, &length);
+    if (!source) {
+        compileError("Could not open '%s'!\n", inputPath);
+    }
+    
+    //set up an anonymous helper file outside the source tree, or stream the tokens to the parser as they are made
+    FILE *helperFile = options.boundMemory ? openLazyTokens(source, length) : tmpfile();
+    if (!helperFile) {
+        compileError("Could not create a helper file for '%s'!\n", inputPath);
+    }
+    
+    //set up output file for writing, it only replaces the old one once the build is done.
+    //When the output is wanted in memory as well, it is compiled there and copied to the file at the end
+    char *outputPath = pathWithInputPath(inputPath, ".vm");
+    FILE *outputFile = compiled ? open_memstream(&compiled->output, &compiled->output_length) : openOutput(outputPath);
+    
+    //the source map lists the source file, then 'instruction line column' wherever the position changes
+    if (options.writeSourceMaps) {
+        char *mapPath = pathWithInputPath(inputPath, ".vm.map");
+        sourceMapFile = openOutput(mapPath);
+        fprintf(sourceMapFile, "%s\n", inputPath);
+        free(mapPath);
+    }
+    
+    memset(&statistics, 0, sizeof(statistics));
+    compileSource(source, length, helperFile, outputFile);
+    
+    if (options.showStatistics) {
+        //ru_maxrss is in kilobytes, but in bytes on macOS
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        long peakKilobytes = usage.ru_maxrss / 1024;
+#else
+        long peakKilobytes = usage.ru_maxrss;
+#endif
+        printf("%s: %zu instructions, %d locals allocated for %d declared, peak RSS so far %ld KB\n", inputPath, statistics.instructions, statistics.allocatedLocals, statistics.declaredLocals, peakKilobytes);
+    }
+    
+    if (options.useInterfaces) {
+        forgetClassInterfaces();
+        size_t interfaceLength = 0;
+        char *interface = writeClassInterface(inputPath, &interfaceLength);
+        if (compiled) {
+            compiled->interface = interface;
+            compiled->interface_length = interfaceLength;
+        } else {
+            free(interface);
+        }
+    }
+    
+    //cleanup
+    resetCompilerState();
+    
+    if (compiled) {
+        fclose(outputFile);
+        outputFile = openOutput(outputPath);
+        fwrite(compiled->output, 1, compiled->output_length, outputFile);
+    }
+    closeOutput(outputFile);
+    
+    if (sourceMapFile) {
+        closeOutput(sourceMapFile);
+        sourceMapFile = NULL;
+    }
+    
+    //a lazy token stream was closed with the compiler state
+    if (!options.boundMemory) {
+        fclose(helperFile);
+    }
+    
+    if (!options.boundMemory) {
+        free(source);
+    } else if (length) {
+        munmap(source, length);
+    }
+    free(outputPath);
+}
+
+//differential testing: compares the generated vm file with the one of the same name in the reference directory
+int matchesReference(char *inputPath) {
+    char *outputPath = pathWithInputPath(inputPath, ".vm");
+    char *name = strrchr(outputPath, '/');
+    name = name ? name + 1 : outputPath;
+    
+    char *referencePath = malloc(strlen(options.referencePath) + strlen(name) + 1 + 1);
+    strcpy(referencePath, options.referencePath);
+    strcat(referencePath, "/");
+    strcat(referencePath, name);
+    
+    int matches = 0;
+    FILE *outputFile = fopen(outputPath, "r");
+    FILE *referenceFile = fopen(referencePath, "r");
+    if (!outputFile || !referenceFile) {
+        printf("Could not compare '%s' with '%s'!\n", outputPath, referencePath);
+    } else {
+        char *outputLine = NULL;
+        char *referenceLine = NULL;
+        size_t outputLength = 0;
+        size_t referenceLength = 0;
+        
+        int lineNumber = 1;
+        while (1) {
+            ssize_t outputCount = getline(&outputLine, &outputLength, outputFile);
+            ssize_t referenceCount = getline(&referenceLine, &referenceLength, referenceFile);
+            if (outputCount < 0 && referenceCount < 0) {
+                matches = 1;
+                break;
             }
             
-            free(statementType);
-        } else if (!strcmp(line, "}")) {
-            fsetpos(inputFile, &pos);
-            break;
-        } else {
-            printf("Not a valid statement type: %s\n", line);
-            exit(1);
+            if (outputCount != referenceCount || strcmp(outputLine, referenceLine)) {
+                printf("'%s' differs from '%s' at line %d\n", outputPath, referencePath, lineNumber);
+                break;
+            }
+            lineNumber++;
         }
+        
+        free(outputLine);
+        free(referenceLine);
+    }
+    
+    if (outputFile) {
+        fclose(outputFile);
+    }
+    if (referenceFile) {
+        fclose(referenceFile);
     }
+    free(referencePath);
+    free(outputPath);
+    
+    return matches;
 }
 
-void compileSubroutineBody(FILE *inputFile, FILE *outputFile, char *subType) {
-    char line[256];
+int comparePaths(const void *first, const void *second) {
+    return strcmp(*(char * const *)first, *(char * const *)second);
+}
+
+//returns the jack files at filepath sorted by path, so output does not depend on the order the file system lists them in.
+//The pointer array and the paths share one allocation, released with freeFiles.
+char **jackFilesAtPath(char *filepath, int *number_of_files) {
+    struct stat path_stat;
+    *number_of_files = 0;
     
-    fgets_nl(line, sizeof(line), inputFile);
-    if (strcmp(line, "{")) {
-        printf("Subroutine Body should begin with '{'!\n");
-        exit(1);
+    char *arena = NULL;
+    size_t length_of_arena = 0;
+    size_t size_of_arena = 0;
+    size_t *offsets = NULL;
+    size_t length_of_offsets = 0;
+    
+    DIR *directory = NULL;
+    if (!stat(filepath, &path_stat) && S_ISDIR(path_stat.st_mode)) {
+        directory = opendir(filepath);
     }
     
-    //compile local variables first
-    int varCount = 0;
-    while (1) {
-        fpos_t pos;
-        fgetpos(inputFile, &pos);
+    struct dirent *entry = NULL;
+    int isSingleFile = !directory && !stat(filepath, &path_stat) && S_ISREG(path_stat.st_mode) && is_jack_file(filepath);
+    while (isSingleFile || (directory && (entry = readdir(directory)))) {
+        if (entry && !is_jack_file(entry->d_name)) { continue; }
         
-        fgets_nl(line, sizeof(line), inputFile);
-        if (!strcmp(line, "var")) {
-            varCount += compileVarDeclaration(inputFile, outputFile);
-        } else {
-            fsetpos(inputFile, &pos);
-            break;
+        size_t directoryLength = entry ? strlen(filepath) + 1 : 0;
+        char *name = entry ? entry->d_name : filepath;
+        size_t length = directoryLength + strlen(name) + 1;
+        if (length_of_arena + length > size_of_arena) {
+            size_of_arena = (size_of_arena + length) * 2;
+            arena = realloc(arena, size_of_arena);
+        }
+        if (*number_of_files == length_of_offsets) {
+            length_of_offsets = length_of_offsets ? length_of_offsets * 2 : 16;
+            offsets = realloc(offsets, length_of_offsets * sizeof(size_t));
         }
+        
+        offsets[(*number_of_files)++] = length_of_arena;
+        if (entry) {
+            memcpy(arena + length_of_arena, filepath, directoryLength - 1);
+            arena[length_of_arena + directoryLength - 1] = '/';
+        }
+        strcpy(arena + length_of_arena + directoryLength, name);
+        length_of_arena += length;
+        
+        isSingleFile = 0;
     }
     
-    fprintf(outputFile, "%d\n", varCount);
+    if (directory) {
+        closedir(directory);
+    }
     
-    if (!strcmp(subType, "method")) {
-        fputs("push argument 0\npop pointer 0\n", outputFile);
-    } else if (!strcmp(subType, "constructor")) {
-        fprintf(outputFile, "push constant %zu\ncall Memory.alloc 1\npop pointer 0\n", *number_of_class_symbols);
+    char **files = malloc(*number_of_files * sizeof(char *) + length_of_arena + 1);
+    char *paths = (char *)(files + *number_of_files);
+    if (arena) {
+        memcpy(paths, arena, length_of_arena);
+    }
+    for (int i = 0; i < *number_of_files; i++) {
+        files[i] = paths + offsets[i];
+    }
+    qsort(files, *number_of_files, sizeof(char *), comparePaths);
+    
+    free(offsets);
+    free(arena);
+    
+    return files;
+}
+
+void freeFiles(char **files) {
+    free(files);
+}
+
+//asks the kernel to start reading a source file in the background, so it is in the page cache by the time it is lexed
+void prefetchFile(char *path) {
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0) { return; }
+    
+#if defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(descriptor, 0, 0, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+    struct stat file_stat;
+    if (!fstat(descriptor, &file_stat)) {
+        struct radvisory advisory;
+        advisory.ra_offset = 0;
+        advisory.ra_count = (int)file_stat.st_size;
+        fcntl(descriptor, F_RDADVISE, &advisory);
     }
+#endif
+    
+    close(descriptor);
+}
 
-    //compile statements
-    while (1) {
-        fpos_t pos;
-        fgetpos(inputFile, &pos);
-        
-        fgets_nl(line, sizeof(line), inputFile);
-        if (!strcmp(line, "}")) {
-            break;
-        } else if (!strcmp(line, "let") || !strcmp(line, "if") || !strcmp(line, "while") || !strcmp(line, "do") || !strcmp(line, "return")) {
-            fsetpos(inputFile, &pos);
-            compileStatements(inputFile, outputFile);
-        } else {
-            printf("Unrecognized statement in subroutine body!\n");
-            exit(1);
+#pragma mark Server
+
+//the server keeps what each file compiled to, and with --interfaces the interface of its class, which describes its
+//subroutines for the compiles of the other classes. Every compile runs in a child process, which is handed the interfaces
+//the server holds and sends its output and interface back. A file is compiled again when its own source or the
+//interface of another class in its directory changes
+typedef struct CachedFile {
+    char *path;
+    struct timespec modified;
+    off_t size;
+    ino_t inode;
+    uint64_t otherInterfacesHash;
+    int status;
+    char *diagnostics;
+    size_t diagnostics_length;
+    char *output;
+    size_t output_length;
+    char *interface;
+    size_t interface_length;
+    uint64_t interfaceHash;
+    int hasKnownInterface; //its interface is kept and its source was unchanged when the current request looked
+} CachedFile;
+
+CachedFile *cached_files;
+size_t number_of_cached_files;
+
+CachedFile *cachedFileWithPath(char *path) {
+    for (size_t i = 0; i < number_of_cached_files; i++) {
+        if (!strcmp(cached_files[i].path, path)) {
+            return &cached_files[i];
         }
     }
+    
+    number_of_cached_files++;
+    cached_files = realloc(cached_files, number_of_cached_files * sizeof(CachedFile));
+    
+    CachedFile *cachedFile = &cached_files[number_of_cached_files - 1];
+    memset(cachedFile, 0, sizeof(CachedFile));
+    cachedFile->path = malloc(strlen(path) + 1);
+    strcpy(cachedFile->path, path);
+    cachedFile->status = -1;
+    
+    return cachedFile;
 }
 
-void compileSubroutineDeclaration(char *subType, FILE *inputFile, FILE *outputFile) {
-    char line[256];
+//whether the file has the size, inode and mtime it had when it was last compiled
+int isCachedFileUnchanged(CachedFile *cachedFile, struct stat *file_stat) {
+    struct timespec modified = modificationTime(file_stat);
+    return cachedFile->status >= 0 && cachedFile->size == file_stat->st_size && cachedFile->inode == file_stat->st_ino &&
+           cachedFile->modified.tv_sec == modified.tv_sec && cachedFile->modified.tv_nsec == modified.tv_nsec;
+}
 
-    //reinitialize sub_symbols because new subroutine is being compiled
-    freeSymbolTable(sub_symbols, number_of_sub_symbols);
-    sub_symbols = initialize_symbol_table(length_of_sub_symbols, number_of_sub_symbols);
-    
-    fgets_nl(line, sizeof(line), inputFile);
-    TokenType lineType = tokenType(line);
-    if (lineType != TokenTypeIdentifier && strcmp(line, "int") && strcmp(line, "char") && strcmp(line, "boolean") && strcmp(line, "void")) {
-        printf("Class subroutine declaration does not have a valid return type!\n");
-        exit(1);
+uint64_t hashBytes(uint64_t hash, const char *bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)bytes[i]) * 0x100000001b3;
     }
+    return hash;
+}
+
+//the hash of an interface starts from the name of its jack file, so two classes swapping interfaces still change it
+uint64_t fileNameHash(char *path) {
+    const char *separator = strrchr(path, '/');
+    const char *name = separator ? separator + 1 : path;
+    return hashBytes(0xcbf29ce484222325, name, strlen(name) + 1);
+}
+
+//copies the length bytes that end at end, or returns NULL for none
+char *takeBytes(const char *end, size_t length) {
+    if (!length) { return NULL; }
     
-    fgets_nl(line, sizeof(line), inputFile);
-    if (tokenType(line) == TokenTypeIdentifier) {
-        fprintf(outputFile, "function %s.%s ", currentClass, line);
-    } else {
-        printf("Class subroutine name must have a valid name!\n");
-        exit(1);
+    char *bytes = malloc(length);
+    memcpy(bytes, end - length, length);
+    return bytes;
+}
+
+//compiles in a child process, so a failing compile cannot take the server down and nothing it allocates outlives it
+void recompileCachedFile(CachedFile *cachedFile) {
+    int diagnostics[2];
+    if (pipe(diagnostics)) {
+        cachedFile->status = -1;
+        return;
     }
     
-    fgets_nl(line, sizeof(line), inputFile);
-    if (strcmp(line, "(")) {
-        printf("Class subroutine missing '('!\n");
-        exit(1);
+    //the child looks the other classes up in the interfaces the server holds before it reads interface files
+    for (size_t i = 0; i < number_of_cached_files; i++) {
+        CachedFile *other = &cached_files[i];
+        if (other == cachedFile || !other->hasKnownInterface) { continue; }
+        addClassInterface(pathWithInputPath(other->path, ".jacki"), (unsigned char *)other->interface, other->interface_length);
     }
     
-    if (!strcmp(subType, "method")) {
-        Symbol *newSymbol = malloc(sizeof(Symbol));
-        
-        newSymbol->name = malloc(strlen("this"));
-        strcpy(newSymbol->name, "this");
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        close(diagnostics[0]);
+        dup2(diagnostics[1], STDOUT_FILENO);
+        close(diagnostics[1]);
         
-        newSymbol->type = malloc(strlen(currentClass));
-        strcpy(newSymbol->type, currentClass);
-        
-        newSymbol->kind = malloc(strlen("argument"));
-        strcpy(newSymbol->kind, "argument");
+        CompiledFile compiled = {NULL, 0, NULL, 0};
+        compileFile(cachedFile->path, &compiled);
+        commitOutputs();
         
-        add_symbol(sub_symbols, newSymbol);
+        //the output and the interface follow the diagnostics, and their lengths come last, so the server finds them from the end
+        uint64_t lengths[2] = {compiled.output_length, compiled.interface_length};
+        fwrite(compiled.output, 1, compiled.output_length, stdout);
+        fwrite(compiled.interface, 1, compiled.interface_length, stdout);
+        fwrite(lengths, sizeof(lengths), 1, stdout);
+        fflush(stdout);
+        _exit(0);
     }
+    close(diagnostics[1]);
+    forgetClassInterfaces();
     
-    compileParameterList(inputFile, outputFile);
+    free(cachedFile->diagnostics);
+    cachedFile->diagnostics = NULL;
+    cachedFile->diagnostics_length = 0;
     
-    fgets_nl(line, sizeof(line), inputFile);
-    if (strcmp(line, ")")) {
-        printf("Class subroutine missing ')' at end of parameter list!\n");
-        exit(1);
+    char buffer[4096];
+    ssize_t count;
+    while ((count = read(diagnostics[0], buffer, sizeof(buffer))) > 0) {
+        cachedFile->diagnostics = realloc(cachedFile->diagnostics, cachedFile->diagnostics_length + count);
+        memcpy(cachedFile->diagnostics + cachedFile->diagnostics_length, buffer, count);
+        cachedFile->diagnostics_length += count;
     }
+    close(diagnostics[0]);
     
-    compileSubroutineBody(inputFile, outputFile, subType);
+    int status = 1;
+    if (child > 0) {
+        waitpid(child, &status, 0);
+    }
+    cachedFile->status = (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : 1;
+    
+    free(cachedFile->output);
+    free(cachedFile->interface);
+    cachedFile->output = NULL;
+    cachedFile->output_length = 0;
+    cachedFile->interface = NULL;
+    cachedFile->interface_length = 0;
+    cachedFile->hasKnownInterface = 0;
+    
+    //a child that exits normally has sent its output, its interface and their lengths after the diagnostics
+    uint64_t lengths[2];
+    if (cachedFile->status == 0 && cachedFile->diagnostics_length >= sizeof(lengths)) {
+        size_t length = cachedFile->diagnostics_length - sizeof(lengths);
+        memcpy(lengths, cachedFile->diagnostics + length, sizeof(lengths));
+        cachedFile->interface = takeBytes(cachedFile->diagnostics + length, lengths[1]);
+        cachedFile->interface_length = lengths[1];
+        cachedFile->output = takeBytes(cachedFile->diagnostics + length - lengths[1], lengths[0]);
+        cachedFile->output_length = lengths[0];
+        cachedFile->diagnostics_length = length - lengths[1] - lengths[0];
+        
+        if (cachedFile->interface) {
+            cachedFile->interfaceHash = hashBytes(fileNameHash(cachedFile->path), cachedFile->interface, cachedFile->interface_length);
+        }
+    } else {
+        cachedFile->status = 1;
+    }
 }
 
-void compileClass(FILE *inputFile, FILE *outputFile) {
-    char line[256];
+//hashes the interface of the class in the jack file at path, from what the server holds while the source is unchanged and
+//from the interface file otherwise. The contents are hashed rather than the mtime, as compiling a class rewrites its
+//interface even when nothing changed
+uint64_t interfaceHash(char *path) {
+    CachedFile *cachedFile = cachedFileWithPath(path);
+    struct stat file_stat;
+    cachedFile->hasKnownInterface = cachedFile->interface && !stat(path, &file_stat) && isCachedFileUnchanged(cachedFile, &file_stat);
+    if (cachedFile->hasKnownInterface) {
+        return cachedFile->interfaceHash;
+    }
     
-    class_symbols = initialize_symbol_table(length_of_class_symbols, number_of_class_symbols);
+    uint64_t hash = fileNameHash(path);
+    char *interfacePath = pathWithInputPath(path, ".jacki");
+    size_t length = 0;
+    char *interface = readWholeFile(interfacePath, &length);
+    if (interface) {
+        hash = hashBytes(hash, interface, length);
+    }
+    free(interface);
+    free(interfacePath);
+    return hash;
+}
+
+//compiles the file again unless it is cached and neither it nor the interfaces of the other classes changed, returns whether it did
+int refreshCachedFile(char *path, uint64_t otherInterfacesHash) {
+    struct stat file_stat;
+    if (stat(path, &file_stat)) { return 0; }
     
-    fgets_nl(line, sizeof(line), inputFile);
-    if (strcmp(line, "class")) {
-        printf("File does not begin with a class declaration!\n");
-        exit(1);
+    CachedFile *cachedFile = cachedFileWithPath(path);
+    if (!isCachedFileUnchanged(cachedFile, &file_stat) || cachedFile->otherInterfacesHash != otherInterfacesHash) {
+        recompileCachedFile(cachedFile);
+        cachedFile->modified = modificationTime(&file_stat);
+        cachedFile->size = file_stat.st_size;
+        cachedFile->inode = file_stat.st_ino;
+        cachedFile->otherInterfacesHash = otherInterfacesHash;
+        return 1;
+    }
+    return 0;
+}
+
+void writeCachedFile(FILE *connection, char *path) {
+    struct stat file_stat;
+    if (stat(path, &file_stat)) {
+        fprintf(connection, "file %s 1 0 0\n", path);
+        return;
     }
     
-    fgets_nl(line, sizeof(line), inputFile);
-    currentClass = malloc(strlen(line));
-    if (tokenType(line) == TokenTypeIdentifier) {
-        strcpy(currentClass, line);
-    } else {
-        printf("Class declaration has no class name!\n");
-        exit(1);
+    CachedFile *cachedFile = cachedFileWithPath(path);
+    fprintf(connection, "file %s %d %zu %zu\n", path, cachedFile->status, cachedFile->diagnostics_length, cachedFile->output_length);
+    fwrite(cachedFile->diagnostics, 1, cachedFile->diagnostics_length, connection);
+    fwrite(cachedFile->output, 1, cachedFile->output_length, connection);
+}
+
+//each request is a single line holding a file or directory path, answered with a 'file <path> <status> <diagnostics length> <vm length>'
+//header followed by the diagnostics and vm output for every jack file found there, and a closing 'end' line
+void handleConnection(int connectionDescriptor) {
+    char request[4096];
+    size_t length = 0;
+    while (length < sizeof(request) - 1) {
+        ssize_t count = read(connectionDescriptor, request + length, sizeof(request) - 1 - length);
+        if (count < 0) {
+            //timed out, or the client went away before finishing the request
+            close(connectionDescriptor);
+            return;
+        }
+        if (count == 0) { break; }
+        
+        length += count;
+        if (memchr(request, '\n', length)) { break; }
     }
+    request[length] = 0;
     
-    fgets_nl(line, sizeof(line), inputFile);
-    if (strcmp(line, "{")) {
-        printf("Class declaration is missing '{'!\n");
-        exit(1);
+    FILE *connection = fdopen(connectionDescriptor, "w");
+    if (!connection) {
+        close(connectionDescriptor);
+        return;
     }
     
-    while (fgets_nl(line, sizeof(line), inputFile)) {
-        if (!strcmp(line, "field") || !strcmp(line, "static")) {
-            compileClassVarDeclaration(line, inputFile, outputFile);
-        } else if (!strcmp(line, "constructor") || !strcmp(line, "function") || !strcmp(line, "method")) {
-            compileSubroutineDeclaration(line, inputFile, outputFile);
-            fputc('\n', outputFile);
-        } else if (!strcmp(line, "}")) {
-            //do nothing
-        } else {
-            printf("Unrecognized keyword specified in class!\n");
-            exit(1);
+    char *path = trim_whitespace(request);
+    int number_of_files = 0;
+    char **files = jackFilesAtPath(path, &number_of_files);
+    
+    //with --interfaces a compile reads the interfaces of the other classes in the directory. Each is hashed once per
+    //request and again only after its class is compiled, the sum of the others' hashes is what a file depends on
+    struct stat path_stat;
+    int isDirectory = !stat(path, &path_stat) && S_ISDIR(path_stat.st_mode);
+    int number_of_classes = 0;
+    char **classes = files;
+    if (options.useInterfaces && number_of_files && !isDirectory) {
+        const char *separator = strrchr(path, '/');
+        char *directory = separator ? strndup(path, separator > path ? separator - path : 1) : copyString(".");
+        classes = jackFilesAtPath(directory, &number_of_classes);
+        free(directory);
+    } else if (options.useInterfaces) {
+        number_of_classes = number_of_files;
+    }
+    
+    uint64_t *interfaceHashes = malloc((number_of_classes + 1) * sizeof(uint64_t));
+    int *classIndexes = malloc((number_of_files + 1) * sizeof(int));
+    uint64_t interfacesHash = 0;
+    for (int i = 0; i < number_of_classes; i++) {
+        interfaceHashes[i] = interfaceHash(classes[i]);
+        interfacesHash += interfaceHashes[i];
+    }
+    for (int i = 0; i < number_of_files; i++) {
+        classIndexes[i] = classes == files && number_of_classes ? i : -1;
+        const char *separator = strrchr(files[i], '/');
+        const char *name = separator ? separator + 1 : files[i];
+        for (int j = 0; j < number_of_classes && classIndexes[i] < 0; j++) {
+            const char *classSeparator = strrchr(classes[j], '/');
+            if (!strcmp(classSeparator ? classSeparator + 1 : classes[j], name)) {
+                classIndexes[i] = j;
+            }
+        }
+    }
+    
+    //a class compiled before another one whose interface then changed is compiled again, until the interfaces settle
+    for (int pass = 0; pass <= number_of_files; pass++) {
+        int isRecompiled = 0;
+        for (int i = 0; i < number_of_files; i++) {
+            int index = classIndexes[i];
+            uint64_t ownHash = index >= 0 ? interfaceHashes[index] : 0;
+            if (!refreshCachedFile(files[i], interfacesHash - ownHash)) { continue; }
+            
+            isRecompiled = 1;
+            if (index >= 0) {
+                interfaceHashes[index] = interfaceHash(files[i]);
+                interfacesHash += interfaceHashes[index] - ownHash;
+            }
         }
+        if (!isRecompiled || !options.useInterfaces) { break; }
+    }
+    for (int i = 0; i < number_of_files; i++) {
+        writeCachedFile(connection, files[i]);
+    }
+    fputs("end\n", connection);
+    
+    if (classes != files) {
+        freeFiles(classes);
+    }
+    free(classIndexes);
+    free(interfaceHashes);
+    freeFiles(files);
+    fclose(connection);
+}
+
+//requests are handled one at a time, so a client that stops sending or reading is dropped after this long
+//instead of holding up the requests queued behind it
+const struct timeval connectionTimeout = {2, 0};
+
+int runServer(char *socketPath) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        printf("Socket path is too long!\n");
+        return 1;
+    }
+    strcpy(address.sun_path, socketPath);
+    
+    int serverDescriptor = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);
+    if (serverDescriptor < 0 || bind(serverDescriptor, (struct sockaddr *)&address, sizeof(address)) || listen(serverDescriptor, 16)) {
+        printf("Could not listen on '%s'!\n", socketPath);
+        return 1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    while (1) {
+        int connectionDescriptor = accept(serverDescriptor, NULL, NULL);
+        if (connectionDescriptor < 0) { continue; }
+        
+        setsockopt(connectionDescriptor, SOL_SOCKET, SO_RCVTIMEO, &connectionTimeout, sizeof(connectionTimeout));
+        setsockopt(connectionDescriptor, SOL_SOCKET, SO_SNDTIMEO, &connectionTimeout, sizeof(connectionTimeout));
+        handleConnection(connectionDescriptor);
+    }
+}
+
+#pragma mark Fuzzing
+
+#ifdef JACK_FUZZ
+//libFuzzer entry point, also usable with AFL++ through its libFuzzer driver. Build without main, e.g.
+//clang -DJACK_FUZZ -D_GNU_SOURCE -g -O1 -fsanitize=fuzzer,address,undefined main.c
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    options.optimize = 1;
+    options.convertTailCalls = 1;
+    options.verifyTokenizer = 1;
+    options.writeSourceMaps = 1;
+    FILE *helperFile = tmpfile();
+    char *output = NULL;
+    size_t outputSize = 0;
+    FILE *outputFile = open_memstream(&output, &outputSize);
+    if (!helperFile || !outputFile) {
+        abort();
+    }
+    
+    currentInputPath = "Fuzz.jack";
+    
+    jmp_buf jump;
+    if (!setjmp(jump)) {
+        errorJump = &jump;
+        compileSource((const char *)data, size, helperFile, outputFile);
     }
+    errorJump = NULL;
+    
+    resetCompilerState();
+    fclose(outputFile);
+    free(output);
+    fclose(helperFile);
+    
+    return 0;
 }
+#else
 
 #pragma mark Main
 
 int main(int argc, const char * argv[]) {
-    char *filepath = malloc(200);
-    printf("Enter filepath bitch> ");
-    scanf("%s", filepath);
+    char *filepath = NULL;
+    char *socketPath = NULL;
+    options.optimize = 1;
+    options.convertTailCalls = 1;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--no-optimize")) {
+            options.optimize = 0;
+        } else if (!strcmp(argv[i], "--no-tail-calls")) {
+            options.convertTailCalls = 0;
+        } else if (!strcmp(argv[i], "--strip-labels")) {
+            options.stripUnusedLabels = 1;
+        } else if (!strcmp(argv[i], "--stats")) {
+            options.showStatistics = 1;
+        } else if (!strcmp(argv[i], "--interfaces")) {
+            options.useInterfaces = 1;
+        } else if (!strcmp(argv[i], "--verify-tokenizer")) {
+            options.verifyTokenizer = 1;
+        } else if (!strcmp(argv[i], "--bounded-memory")) {
+            options.boundMemory = 1;
+        } else if (!strcmp(argv[i], "--source-map")) {
+            options.writeSourceMaps = 1;
+        } else if (!strcmp(argv[i], "--profile-use") && i + 1 < argc) {
+            options.profilePath = (char *)argv[++i];
+        } else if (!strcmp(argv[i], "--compare") && i + 1 < argc) {
+            options.referencePath = (char *)argv[++i];
+        } else if (!strcmp(argv[i], "--server") && i + 1 < argc) {
+            socketPath = (char *)argv[++i];
+        } else if (argv[i][0] != '-' && !filepath) {
+            filepath = malloc(strlen(argv[i]) + 1);
+            strcpy(filepath, argv[i]);
+        } else {
+            printf("Usage: %s [--no-optimize] [--no-tail-calls] [--strip-labels] [--stats] [--interfaces] [--verify-tokenizer] [--bounded-memory] [--source-map] [--profile-use profile] [--compare reference] [--server socket] [path]\n", argv[0]);
+            return 1;
+        }
+    }
     
-    filepath = trim_whitespace(filepath);
+    if (options.profilePath) {
+        loadProfile(options.profilePath);
+    }
     
-    struct stat path_stat;
-    stat(filepath, &path_stat);
-    int number_of_files = 0;
-    char **files = malloc(sizeof(char *));
+    //outputs are moved into place together once the build is done, or by the exit of a failed compile
+    atexit(commitOutputs);
     
-    if (S_ISDIR(path_stat.st_mode)) {
-        DIR *directory;
-        struct dirent *entry;
-        
-        directory = opendir(filepath);
-        if (directory != NULL) {
-            while ((entry = readdir(directory))) {
-                if (!is_jack_file(entry->d_name)) { continue; }
-                
-                number_of_files++;
-                files = realloc(files, number_of_files * sizeof(char *));
-                
-                size_t new_index = number_of_files - 1;
-                char *entry_path = malloc(strlen(filepath) + strlen(entry->d_name) + 1 + 1);
-                strcpy(entry_path, filepath);
-                strcat(entry_path, "/");
-                strcat(entry_path, entry->d_name);
-                size_t entry_length = strlen(entry_path) + 1;
-                files[new_index] = malloc(entry_length);
-                strcpy(files[new_index], entry_path);
-                free(entry_path);
-            }
-            
-            closedir(directory);
-        }
-    } else if (S_ISREG(path_stat.st_mode) && is_jack_file(filepath)) {
-        number_of_files = 1;
-        files[0] = malloc(strlen(filepath) + 1);
-        strcpy(files[0], filepath);
+    if (socketPath) {
+        return runServer(socketPath);
+    }
+    
+    if (!filepath) {
+        filepath = malloc(200);
+        printf("Enter filepath bitch> ");
+        scanf("%199s", filepath);
     }
     
+    int number_of_files = 0;
+    char **files = jackFilesAtPath(filepath, &number_of_files);
     free(filepath);
     
     if (number_of_files == 0) {
         printf("No jack files found\n");
+        freeFiles(files);
         return 1;
     }
 
-    labelNumber = 1;
+    //keep a window of files being read ahead of the one being compiled
+    const int prefetchWindow = 16;
+    for (int i = 0; i < number_of_files && i < prefetchWindow; i++) {
+        prefetchFile(files[i]);
+    }
+    
     for (int i = 0; i < number_of_files; i++) {
-        //set up input file for reading
-        char *inputPath = files[i];
-        FILE *inputFile = fopen(inputPath, "r");
-        
-        //set up helper file for writing
-        char *helperPath = pathWithInputPath(inputPath, ".txt");
-        FILE *helperFile = fopen(helperPath, "w+");
-        
-        //tokenizer
-        char line[256];
-        while (fgets(line, sizeof(line), inputFile)) {
-            char *trimmed = trim_whitespace(line);
-            
-            if ((trimmed[0] == '/' && (trimmed[1] == '/' || trimmed[1] == '*')) || trimmed[0] == '*' ||
-                isspace(trimmed[0]) || !strcmp(trimmed, "") || !strcmp(trimmed, "\r\n")) { continue; }
-            
-            int printingString = 0;
-            for (int i = 0; i < strlen(trimmed); i++) {
-                char c = trimmed[i];
-                
-                fseek(helperFile, -1, SEEK_CUR);
-                char previous = fgetc(helperFile);
-                
-                if (printingString && c != '"') {
-                    fputc(c, helperFile);
-                } else if (c == '/' && i+1 < strlen(trimmed) && trimmed[i+1] == '/') {
-                    break; //skip rest of line
-                } else if (isSymbol(c)) {
-                    if (previous != '\n') {
-                        fputc('\n', helperFile);
-                    }
-                    
-                    if (c == '<') {
-                        fputs("&lt;", helperFile);
-                    } else if (c == '>') {
-                        fputs("&gt;", helperFile);
-                    } else if (c == '&') {
-                        fputs("&amp;", helperFile);
-                    } else {
-                        fputc(c, helperFile);
-                    }
-                    
-                    fputc('\n', helperFile);
-                } else if (c == '"') {
-                    if (!printingString && previous != '\n') {
-                        fputc('\n', helperFile);
-                    }
-                    
-                    fputc(c, helperFile);
-                    printingString = !printingString;
-                } else if (c == ' ') {
-                    if (previous != '\n') {
-                        fputc('\n', helperFile);
-                    }
-                } else {
-                    fputc(c, helperFile);
-                }
-            }
+        if (i + prefetchWindow < number_of_files) {
+            prefetchFile(files[i + prefetchWindow]);
         }
-        
-        //set up output file for writing
-        char *outputPath = pathWithInputPath(inputPath, ".vm");
-        FILE *outputFile = fopen(outputPath, "w");
-        
-        //initialize symbol table counts
-        length_of_class_symbols = malloc(sizeof(size_t));
-        length_of_sub_symbols = malloc(sizeof(size_t));
-        number_of_class_symbols = malloc(sizeof(size_t));
-        number_of_sub_symbols = malloc(sizeof(size_t));
-        
-        *length_of_class_symbols = 0;
-        *length_of_sub_symbols = 0;
-        *number_of_class_symbols = 0;
-        *number_of_sub_symbols = 0;
-        
-        //parse
-        rewind(helperFile);
-        compileClass(helperFile, outputFile);
-        
-        //cleanup
-        freeSymbolTable(class_symbols, number_of_class_symbols);
-        class_symbols = NULL;
-        
-        freeSymbolTable(sub_symbols, number_of_sub_symbols);
-        sub_symbols = NULL;
-        
-        free(length_of_class_symbols);
-        free(length_of_sub_symbols);
-        free(number_of_class_symbols);
-        free(number_of_sub_symbols);
-        
-        free(currentClass);
-        currentClass = NULL;
-        
-        fclose(outputFile);
-        
-        fclose(helperFile);
-        remove(helperPath);
+        compileFile(files[i], NULL);
     }
+    commitOutputs();
     
-    free(files);
+    int mismatches = 0;
+    for (int i = 0; options.referencePath && i < number_of_files; i++) {
+        if (!matchesReference(files[i])) {
+            mismatches++;
+        }
+    }
     
-    return 0;
+    if (mismatches) {
+        printf("%d of %d files differ from the reference output\n", mismatches, number_of_files);
+    }
+    
+    freeFiles(files);
+    
+    return mismatches ? 1 : 0;
 }
+#endif